@@ -20,9 +20,12 @@ ControlVertex::TransformDelta(const mat4 &mat)
 	// TODO: this is stupid. don't want to recalculate this all the time
 	mat4 delta = glm::inverse(parent->node->globalMatrix) * mat * parent->node->globalMatrix;
 	pos = delta * vec4(vec3(pos), 1.0f);
-	parent->dirty |= DIRTY_POS;
+	parent->CVMoved(this);
 }
 
+// Tessellate on the GPU, the CPU mesh is then only built for picking
+bool gpuTessellation = false;
+float tessPixels = 8.0f;	// target screen length of GPU tessellated edges
 
 BezierSurface*
 CreateBezierSurface(void)
@@ -31,11 +34,17 @@ CreateBezierSurface(void)
 	for(u32 i = 0; i < nelem(surf->CVs); i++)
 		surf->CVs[i].parent = surf;
 	surf->surfaceMesh = nil;
+	surf->patchMesh = nil;
 	surf->hullMesh = nil;
 	surf->curveMesh = nil;
 	surf->cvMesh = nil;
 	surf->dirty = DIRTY_POS | DIRTY_SEL;
 	surf->matID = MATID_DEFAULT;
+	for(int i = 0; i < 4; i++)
+		surf->edgeSegs[i] = 0;
+	surf->segsU = 0;
+	surf->segsV = 0;
+	surf->surfDirty = 0;
 
 	return surf;
 }
@@ -44,14 +53,33 @@ BezierSurface::~BezierSurface(void)
 {
 	delete hullMesh;
 	delete surfaceMesh;
+	delete patchMesh;
 	delete curveMesh;
 	delete cvMesh;
 }
 
+static bool
+UseGPUTessellation(void)
+{
+	return gpuTessellation && tessProg.program > 0;
+}
+
 void
 BezierSurface::DrawShaded(void)
 {
 	Update();
+	if(UseGPUTessellation()) {
+		tessProg.Use();
+		SetCamera();
+		SetWorldMatrix(worldMat);
+		SetLighting(curLighting);
+		glUniform1f(tessProg.u_tessPixels, tessPixels);
+		glPatchParameteri(GL_PATCH_VERTICES, 4*4);
+		patchMesh->submeshes[0].matID = matID;
+		patchMesh->DrawShaded();
+		defProg.Use();
+		return;
+	}
 	surfaceMesh->submeshes[0].matID = matID;
 	surfaceMesh->DrawShaded();
 }
@@ -78,20 +106,113 @@ BezierSurface::DrawHull(bool active)
 	cvMesh->DrawVertices(active);
 }
 
+bool
+BezierSurface::IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist)
+{
+	float u, v;
+	return IntersectRayUV(matrix, orig, dir, dist, u, v);
+}
+
+bool
+BezierSurface::IntersectRayUV(const mat4 &matrix, vec3 orig, vec3 dir, float &dist, float &u, float &v)
+{
+	if(!BoundOnRay(matrix, orig, dir))
+		return false;
+	mat4 inv = glm::inverse(matrix);
+	vec4 cvs[16];
+	for(int i = 0; i < 16; i++)
+		cvs[i] = vec4(vec3(CVs[i].pos), 1.0f);
+	// only hits on the pick segment, dir reaches the far plane
+	float t = 1.0f;
+	if(!IntersectRayPatch(cvs, sizeof(vec4), 4, 3, 3, vec3(inv * vec4(orig, 1.0f)), glm::mat3(inv) * dir, t, u, v))
+		return false;
+	dist = t;
+	return true;
+}
+
+bool
+BezierSurface::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
+{
+	if(!BoundInFrustum(matrix, planes))
+		return false;
+	UpdateSurfaceMesh();
+	return surfaceMesh->IntersectFrustum(matrix, planes);
+}
+
+// The patch lies in the convex hull of its CVs
+void
+BezierSurface::UpdateBound(void)
+{
+	if(!(dirty & (DIRTY_POS|DIRTY_CVS)))
+		return;
+	boundBox.Init();
+	for(int i = 0; i < 4*4; i++)
+		boundBox.ContainPoint(vec3(CVs[i].pos));
+	boundSphere.FromBox(boundBox);
+}
+
 void
 BezierSurface::Update(void)
 {
+	UpdateBound();
+	surfDirty |= dirty;
+	// the patch is kept up to date once it exists, it's only 16 CVs
+	if(UseGPUTessellation() || patchMesh)
+		UpdatePatch();
+	if(!UseGPUTessellation())
+		UpdateSurfaceMesh();
 	UpdateCVs();
 	UpdateHull();
-	UpdateSurf();
 	UpdateCurve();
 	dirty = 0;
 }
 
+// Apply all changes since the last time to the CPU mesh
+void
+BezierSurface::UpdateSurfaceMesh(void)
+{
+	int d = dirty;
+	// also called for picking without Update
+	dirty |= surfDirty;
+	UpdateTessellation();
+	UpdateSurf();
+	dirty = d;
+	surfDirty = 0;
+	surfaceMesh->boundBox = boundBox;
+	surfaceMesh->boundSphere = boundSphere;
+}
+
+void
+BezierSurface::UpdatePatch(void)
+{
+	if(!(dirty & DIRTY_POS) && patchMesh)
+		return;
+
+	Vertex *verts;
+	if(patchMesh)
+		verts = (Vertex*)patchMesh->vertices;
+	else
+		verts = new Vertex[4*4];
+	for(int i = 0; i < 4*4; i++) {
+		verts[i].pos[0] = CVs[i].pos.x;
+		verts[i].pos[1] = CVs[i].pos.y;
+		verts[i].pos[2] = CVs[i].pos.z;
+	}
+	if(patchMesh) {
+		patchMesh->UpdateMesh();
+		return;
+	}
+
+	u16 *indices = new u16[4*4];
+	for(int i = 0; i < 4*4; i++)
+		indices[i] = i;
+	patchMesh = CreateMesh(GL_PATCHES, 4*4, verts, 4*4, indices, &vertexLayout);
+}
+
 void
 BezierSurface::UpdateCVs(void)
 {
-	if(!dirty)
+	if(!(dirty & (DIRTY_SEL|DIRTY_POS)))
 		return;
 
 	InstData *instData;
@@ -138,7 +259,7 @@ BezierSurface::UpdateCVs(void)
 	memcpy(verts, vertices, sizeof(vertices));
 	memcpy(inds, indices, sizeof(indices));
 
-	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, sizeof(Vertex), instData, 4*4);
+	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, &iconVertexLayout, instData, 4*4);
 }
 
 void
@@ -147,13 +268,13 @@ BezierSurface::UpdateHull(void)
 	int N = 4;
 //	int numIndices = 2*N*(N + N-2);
 	int numIndices = 2*2*N*(N-1);
-	Vertex *verts;
+	LineVertex *verts;
 	u16 *indices;
 	if(dirty & DIRTY_POS || hullMesh == nil) {
 		if(hullMesh)
-			verts = (Vertex*)hullMesh->vertices;
+			verts = (LineVertex*)hullMesh->vertices;
 		else
-			verts = new Vertex[N*N];
+			verts = new LineVertex[N*N];
 
 		for(int i = 0; i < N*N; i++) {
 			verts[i].pos[0] = CVs[i].pos.x;
@@ -208,7 +329,7 @@ BezierSurface::UpdateHull(void)
 	}
 
 	if(hullMesh == nil) {
-		hullMesh = CreateMesh(GL_LINES, N*N, verts, numIndices, indices, sizeof(Vertex));
+		hullMesh = CreateMesh(GL_LINES, N*N, verts, numIndices, indices, &lineVertexLayout);
 		hullMesh->submeshes[0].matID = MATID_HULL;
 		Mesh::Submesh sm;
 		sm.numIndices = 0;
@@ -217,24 +338,377 @@ BezierSurface::UpdateHull(void)
 	}
 }
 
+// |C''|/8 of a cubic from its control polygon
+static float
+CubicCurvature(vec3 p0, vec3 p1, vec3 p2, vec3 p3)
+{
+	return 6.0f*max(length(p2 - 2.0f*p1 + p0), length(p3 - 2.0f*p2 + p1))/8.0f;
+}
+
+static float
+PatchTolerance(Node *node, const vec3 *points, int n)
+{
+	float tol = surfaceTolerance;
+	if(pixelTolerance > 0.0f) {
+		Box box;
+		Sphere sphere;
+		box.Init();
+		for(int i = 0; i < n; i++)
+			box.ContainPoint(points[i]);
+		sphere.FromBox(box);
+		mat4 matrix = node ? node->globalMatrix : mat4(1.0f);
+		// no hysteresis, patches sharing an edge have to agree on its level
+		if(tol > 0.0f)
+			tol = LevelTolerance(SelectLevel(DetailLevel(pixelTolerance, matrix, sphere, tol), -1), tol);
+		else
+			tol = PixelsToObject(pixelTolerance, matrix, sphere);
+	}
+	return tol;
+}
+
+// CVs of the edges in the order of edgeSegs
+static int patchEdges[4][4] = {
+	{ 0, 1, 2, 3 },
+	{ 3, 7, 11, 15 },
+	{ 15, 14, 13, 12 },
+	{ 12, 8, 4, 0 }
+};
+
+// Each boundary edge is subdivided by looking only at its own
+// CVs, so patches that share an edge always agree on its samples.
+// The interior can be denser and is stitched to the edges.
+// Sets DIRTY_TESS if anything changed.
+void
+BezierSurface::UpdateTessellation(void)
+{
+	vec3 p[4*4];
+	for(int i = 0; i < 4*4; i++)
+		p[i] = vec3(CVs[i].pos);
+
+	bool changed = false;
+	for(int e = 0; e < 4; e++) {
+		vec3 ep[4];
+		for(int i = 0; i < 4; i++)
+			ep[i] = p[patchEdges[e][i]];
+		int n = SegmentsForTolerance(CubicCurvature(ep[0], ep[1], ep[2], ep[3]), PatchTolerance(node, ep, 4));
+		changed |= n != edgeSegs[e];
+		edgeSegs[e] = n;
+	}
+
+	float duu = 0.0f;
+	float dvv = 0.0f;
+	float duv = 0.0f;
+	for(int i = 0; i < 4; i++)
+		for(int j = 0; j < 2; j++) {
+			duu = max(duu, length(p[i*4 + j+2] - 2.0f*p[i*4 + j+1] + p[i*4 + j]));
+			dvv = max(dvv, length(p[(j+2)*4 + i] - 2.0f*p[(j+1)*4 + i] + p[j*4 + i]));
+		}
+	for(int i = 0; i < 3; i++)
+		for(int j = 0; j < 3; j++)
+			duv = max(duv, length(p[(i+1)*4 + j+1] - p[(i+1)*4 + j] - p[i*4 + j+1] + p[i*4 + j]));
+	float tol = PatchTolerance(node, p, 4*4);
+	// need at least one interior row and column to stitch to
+	int nu = max(SegmentsForTolerance((6.0f*duu + 9.0f*duv)/8.0f, tol), max(max(edgeSegs[0], edgeSegs[2]), 2));
+	int nv = max(SegmentsForTolerance((6.0f*dvv + 9.0f*duv)/8.0f, tol), max(max(edgeSegs[1], edgeSegs[3]), 2));
+	if(nu != segsU || nv != segsV) {
+		segsU = nu;
+		segsV = nv;
+		changed = true;
+	}
+	if(changed)
+		dirty |= DIRTY_TESS;
+}
+
+// Triangulate between the chains a and b which run in the same direction,
+// ta and tb are the positions along it. Returns number of indices.
+static int
+Zip(u16 *indices, const u16 *a, const float *ta, int na, const u16 *b, const float *tb, int nb)
+{
+	int idx = 0;
+	int i = 0;
+	int j = 0;
+	while(i < na-1 || j < nb-1) {
+		indices[idx++] = a[i];
+		if(j == nb-1 || (i < na-1 && ta[i+1] < tb[j+1])) {
+			indices[idx++] = a[i+1];
+			indices[idx++] = b[j];
+			i++;
+		} else {
+			indices[idx++] = b[j+1];
+			indices[idx++] = b[j];
+			j++;
+		}
+	}
+	return idx;
+}
+
+// Tessellation samples lie on lines of constant u or v at uniform
+// steps, so they can be stepped with forward differences of the
+// power basis instead of evaluating every sample.
+
+static float bezierToPower[4][4] = {
+	{  1.0f,  0.0f,  0.0f, 0.0f },
+	{ -3.0f,  3.0f,  0.0f, 0.0f },
+	{  3.0f, -6.0f,  3.0f, 0.0f },
+	{ -1.0f,  3.0f, -3.0f, 1.0f }
+};
+
+// A[i][j] is the coefficient of v^i u^j
+static void
+PowerBasis(const ControlVertex *CVs, vec3 A[4][4])
+{
+	vec3 T[4][4];
+	for(int k = 0; k < 4; k++)
+		for(int j = 0; j < 4; j++) {
+			T[k][j] = vec3(0.0f);
+			for(int l = 0; l <= j; l++)
+				T[k][j] += bezierToPower[j][l]*vec3(CVs[k*4 + l].pos);
+		}
+	for(int i = 0; i < 4; i++)
+		for(int j = 0; j < 4; j++) {
+			A[i][j] = vec3(0.0f);
+			for(int k = 0; k <= i; k++)
+				A[i][j] += bezierToPower[i][k]*T[k][j];
+		}
+}
+
+// value and differences of c0 + c1 t + c2 t^2 + c3 t^3 with step h
+struct ForwardDiff
+{
+	vec3 f, d1, d2, d3;
+
+	void Init(vec3 c0, vec3 c1, vec3 c2, vec3 c3, float h) {
+		float h2 = h*h;
+		float h3 = h2*h;
+		f = c0;
+		d1 = c1*h + c2*h2 + c3*h3;
+		d2 = 2.0f*c2*h2 + 6.0f*c3*h3;
+		d3 = 6.0f*c3*h3;
+	}
+	void Step(void) {
+		f += d1;
+		d1 += d2;
+		d2 += d3;
+	}
+};
+
+// Sample t = i/n, i = 0..n, along the line s = const, where s is v
+// or u if transposed. dt and ds are the derivatives and can be nil.
+static void
+ForwardDiffLine(const vec3 A[4][4], bool transposed, float s, int n, vec3 *pos, vec3 *dt, vec3 *ds)
+{
+	vec3 c[4], cs[4];
+	for(int j = 0; j < 4; j++) {
+		const vec3 &a0 = transposed ? A[j][0] : A[0][j];
+		const vec3 &a1 = transposed ? A[j][1] : A[1][j];
+		const vec3 &a2 = transposed ? A[j][2] : A[2][j];
+		const vec3 &a3 = transposed ? A[j][3] : A[3][j];
+		c[j] = ((a3*s + a2)*s + a1)*s + a0;
+		cs[j] = (3.0f*a3*s + 2.0f*a2)*s + a1;
+	}
+	float h = 1.0f/n;
+	ForwardDiff p, d, e;
+	p.Init(c[0], c[1], c[2], c[3], h);
+	for(int i = 0; i <= n; i++) {
+		pos[i] = p.f;
+		p.Step();
+	}
+	if(dt) {
+		d.Init(c[1], 2.0f*c[2], 3.0f*c[3], vec3(0.0f), h);
+		for(int i = 0; i <= n; i++) {
+			dt[i] = d.f;
+			d.Step();
+		}
+	}
+	if(ds) {
+		e.Init(cs[0], cs[1], cs[2], cs[3], h);
+		for(int i = 0; i <= n; i++) {
+			ds[i] = e.f;
+			e.Step();
+		}
+	}
+}
+
+// Same as NormalFromDerivs for a whole line but without branches,
+// degenerate normals are 0 for the caller to fix.
+static void
+LineNormals(const vec3 *du, const vec3 *dv, vec3 *n, int count)
+{
+	for(int i = 0; i < count; i++) {
+		vec3 c = cross(du[i], dv[i]);
+		float len2 = dot(c, c);
+		float m = 1.0e-5f*max(dot(du[i], du[i]), dot(dv[i], dv[i]));
+		float s = len2 > m*m && len2 > 0.0f ? 1.0f/sqrtf(len2) : 0.0f;
+		n[i] = c*s;
+	}
+}
+
+void
+BezierSurface::UpdateSurf(void)
+{
+	if(!(dirty & (DIRTY_POS|DIRTY_TESS)))
+		return;
+
+	// the boundary ring counterclockwise from (0,0), then the interior grid
+	int nu = segsU;
+	int nv = segsV;
+	int numRing = edgeSegs[0] + edgeSegs[1] + edgeSegs[2] + edgeSegs[3];
+	int numVerts = numRing + (nu-1)*(nv-1);
+	int numTris = 2*(nu-2)*(nv-2) + numRing + 2*nu + 2*nv - 8;
+
+	PackedVertex *verts;
+	u16 *indices;
+	if(surfaceMesh) {
+		if(dirty & DIRTY_TESS)
+			surfaceMesh->Resize(numVerts, 3*numTris);
+		verts = (PackedVertex*)surfaceMesh->vertices;
+		indices = surfaceMesh->indices;
+	} else {
+		verts = new PackedVertex[numVerts];
+		indices = new u16[3*numTris];
+	}
+
+	// full precision for the normal fixups and the winding
+	std::vector<vec2> uvs(numVerts);
+	std::vector<vec3> normals(numVerts);
+	vec3 A[4][4];
+	vec3 pos[MAX_SEGMENTS+1], dt[MAX_SEGMENTS+1], ds[MAX_SEGMENTS+1], n[MAX_SEGMENTS+1];
+	PowerBasis(CVs, A);
+	int vi = 0;
+	for(int e = 0; e < 4; e++) {
+		// edges 1 and 3 are lines of constant u, 2 and 3 run backwards
+		int segs = edgeSegs[e];
+		ForwardDiffLine(A, e & 1, e == 1 || e == 2 ? 1.0f : 0.0f, segs, pos, dt, ds);
+		if(e & 1)
+			LineNormals(ds, dt, n, segs+1);
+		else
+			LineNormals(dt, ds, n, segs+1);
+		for(int j = 0; j < segs; j++, vi++) {
+			int k = e < 2 ? j : segs-j;
+			float t = (float)k/segs;
+			switch(e) {
+			case 0: uvs[vi] = vec2(t, 0.0f); break;
+			case 1: uvs[vi] = vec2(1.0f, t); break;
+			case 2: uvs[vi] = vec2(t, 1.0f); break;
+			case 3: uvs[vi] = vec2(0.0f, t); break;
+			}
+			memcpy(verts[vi].pos, &pos[k], sizeof(verts->pos));
+			normals[vi] = n[k];
+		}
+	}
+	for(int iv = 1; iv < nv; iv++) {
+		ForwardDiffLine(A, false, (float)iv/nv, nu, pos, dt, ds);
+		LineNormals(dt, ds, n, nu+1);
+		for(int iu = 1; iu < nu; iu++, vi++) {
+			uvs[vi] = vec2((float)iu/nu, (float)iv/nv);
+			memcpy(verts[vi].pos, &pos[iu], sizeof(verts->pos));
+			normals[vi] = n[iu];
+		}
+	}
+
+	for(int i = 0; i < numVerts; i++) {
+		PackedVertex *vx = &verts[i];
+		vec3 n = normals[i];
+		if(n == vec3(0.0f))
+			n = EvalNormal(uvs[i].x, uvs[i].y);
+		vx->normal = PackNormal(n);
+		vx->uv[0] = PackHalf(uvs[i].x);
+		vx->uv[1] = PackHalf(uvs[i].y);
+		vx->color[0] = (n.x+1.0f)*0.5f * 255;
+		vx->color[1] = (n.y+1.0f)*0.5f * 255;
+		vx->color[2] = (n.z+1.0f)*0.5f * 255;
+		vx->color[3] = 255;
+	}
+	if(surfaceMesh && !(dirty & DIRTY_TESS)) {
+		surfaceMesh->UpdateMesh();
+		return;
+	}
+
+	#define INNER(iu, iv) (numRing + ((iv)-1)*(nu-1) + (iu)-1)
+	int idx = 0;
+	for(int iv = 1; iv < nv-1; iv++) {
+		for(int iu = 1; iu < nu-1; iu++) {
+			indices[idx++] = INNER(iu, iv);
+			indices[idx++] = INNER(iu, iv+1);
+			indices[idx++] = INNER(iu+1, iv);
+
+			indices[idx++] = INNER(iu+1, iv);
+			indices[idx++] = INNER(iu, iv+1);
+			indices[idx++] = INNER(iu+1, iv+1);
+		}
+	}
+	// stitch each edge to the outermost interior row or column
+	u16 a[MAX_SEGMENTS+1], b[MAX_SEGMENTS];
+	float ta[MAX_SEGMENTS+1], tb[MAX_SEGMENTS];
+	int first = 0;
+	for(int e = 0; e < 4; e++) {
+		int na = edgeSegs[e]+1;
+		for(int i = 0; i < na; i++) {
+			a[i] = (first + i) % numRing;
+			ta[i] = (float)i/edgeSegs[e];
+		}
+		first += edgeSegs[e];
+		int n = e & 1 ? nv : nu;
+		for(int i = 1; i < n; i++) {
+			tb[i-1] = (float)i/n;
+			switch(e) {
+			case 0: b[i-1] = INNER(i, 1); break;
+			case 1: b[i-1] = INNER(nu-1, i); break;
+			case 2: b[i-1] = INNER(nu-i, nv-1); break;
+			case 3: b[i-1] = INNER(1, nv-i); break;
+			}
+		}
+		idx += Zip(&indices[idx], a, ta, na, b, tb, n-1);
+	}
+	#undef INNER
+	assert(idx == 3*numTris);
+
+	// match the winding of the interior grid
+	for(int i = 0; i < idx; i += 3) {
+		vec2 d1 = uvs[indices[i+1]] - uvs[indices[i]];
+		vec2 d2 = uvs[indices[i+2]] - uvs[indices[i]];
+		float area = d1.x*d2.y - d2.x*d1.y;
+		if(area > 0.0f)
+			std::swap(indices[i+1], indices[i+2]);
+	}
+
+	if(surfaceMesh) {
+		surfaceMesh->submeshes[0].numIndices = idx;
+		surfaceMesh->UpdateMesh();
+		surfaceMesh->UpdateIndices();
+		return;
+	}
+	surfaceMesh = CreateMesh(GL_TRIANGLES, numVerts, verts, idx, indices, &packedVertexLayout);
+}
+
 void
 BezierSurface::UpdateCurve(void)
 {
 	if(!(dirty & DIRTY_POS))
 		return;
-	assert(surfaceMesh);
-	int N = 10;
-	Vertex *verts;
+	const int N = 10;
+	LineVertex *verts;
 	if(curveMesh)
-		verts = (Vertex*)curveMesh->vertices;
+		verts = (LineVertex*)curveMesh->vertices;
 	else
-		verts = new Vertex[N*N];
-	memcpy(verts, surfaceMesh->vertices, surfaceMesh->numVertices*surfaceMesh->stride);
+		verts = new LineVertex[N*N];
+	vec3 A[4][4];
+	vec3 pos[N];
+	PowerBasis(CVs, A);
+	for(int iv = 0; iv < N; iv++) {
+		ForwardDiffLine(A, false, (float)iv/(N-1), N-1, pos, nil, nil);
+		for(int iu = 0; iu < N; iu++) {
+			verts[iv*N + iu].pos[0] = pos[iu].x;
+			verts[iv*N + iu].pos[1] = pos[iu].y;
+			verts[iv*N + iu].pos[2] = pos[iu].z;
+		}
+	}
 
-	for(u32 i = 0; i < surfaceMesh->numVertices; i++) {
+	for(int i = 0; i < N*N; i++) {
 		verts[i].color[0] = 0;
 		verts[i].color[1] = 0;
 		verts[i].color[2] = 0;
+		verts[i].color[3] = 255;
 	}
 	if(curveMesh) {
 		curveMesh->UpdateMesh();
@@ -258,74 +732,7 @@ BezierSurface::UpdateCurve(void)
 		}
 	}
 
-	curveMesh = CreateMesh(GL_LINES, surfaceMesh->numVertices, verts, 2*N*(N + N-2), indices, sizeof(Vertex));
-}
-
-void
-BezierSurface::UpdateSurf(void)
-{
-	if(!(dirty & DIRTY_POS))
-		return;
-	int N = 10;
-	Vertex *verts;
-	if(surfaceMesh)
-		verts = (Vertex*)surfaceMesh->vertices;
-	else
-		verts = new Vertex[N*N];
-
-	float eps = 0.001f;
-	for(int iv = 0; iv < N; iv++) {
-		float v = (float)iv/(N-1);
-		for(int iu = 0; iu < N; iu++) {
-			float u = (float)iu/(N-1);
-			vec3 pos = Eval(u, v);
-			Vertex *vx = &verts[iv*N + iu];
-			vx->pos[0] = pos.x;
-			vx->pos[1] = pos.y;
-			vx->pos[2] = pos.z;
-
-			vec3 v1, v2;
-			if(iu == N-1)
-				v1 = pos - Eval(u-eps, v);
-			else
-				v1 = Eval(u+eps, v) - pos;
-			if(iv == N-1)
-				v2 = pos - Eval(u, v-eps);
-			else
-				v2 = Eval(u, v+eps) - pos;
-			vec3 n = normalize(cross(v1, v2));
-			if(length(n) == 0.0f)
-				n = vec3(0.0f, 0.0f, 1.0f);
-
-			vx->normal[0] = n.x;
-			vx->normal[1] = n.y;
-			vx->normal[2] = n.z;
-			vx->color[0] = (n.x+1.0f)*0.5f * 255;
-			vx->color[1] = (n.y+1.0f)*0.5f * 255;
-			vx->color[2] = (n.z+1.0f)*0.5f * 255;
-			vx->color[3] = 255;
-		}
-	}
-	if(surfaceMesh) {
-		surfaceMesh->UpdateMesh();
-		return;
-	}
-
-	u16 *indices = new u16[3*2*(N-1)*(N-1)];
-	int idx = 0;
-	for(int iv = 0; iv < N-1; iv++) {
-		for(int iu = 0; iu < N-1; iu++) {
-			indices[idx++] = iv*N + iu;
-			indices[idx++] = (iv+1)*N + iu;
-			indices[idx++] = iv*N + iu+1;
-
-			indices[idx++] = iv*N + iu+1;
-			indices[idx++] = (iv+1)*N + iu;
-			indices[idx++] = (iv+1)*N + iu+1;
-		}
-	}
-
-	surfaceMesh = CreateMesh(GL_TRIANGLES, N*N, verts, 3*2*(N-1)*(N-1), indices, sizeof(Vertex));
+	curveMesh = CreateMesh(GL_LINES, N*N, verts, 2*N*(N + N-2), indices, &lineVertexLayout);
 }
 
 vec3
@@ -349,6 +756,58 @@ BezierSurface::Eval(float u, float v)
 	return vec3(out);
 }
 
+void
+BezierSurface::EvalDerivs(float u, float v, vec3 *pos, vec3 *du, vec3 *dv)
+{
+	float us[4], vs[4], dus[4], dvs[4];
+	float iu = 1.0f-u;
+	float iv = 1.0f-v;
+	us[0] = iu*iu*iu;
+	us[1] = 3.0f*u*iu*iu;
+	us[2] = 3.0f*u*u*iu;
+	us[3] = u*u*u;
+	vs[0] = iv*iv*iv;
+	vs[1] = 3.0f*v*iv*iv;
+	vs[2] = 3.0f*v*v*iv;
+	vs[3] = v*v*v;
+	dus[0] = -3.0f*iu*iu;
+	dus[1] = 3.0f*iu*iu - 6.0f*u*iu;
+	dus[2] = 6.0f*u*iu - 3.0f*u*u;
+	dus[3] = 3.0f*u*u;
+	dvs[0] = -3.0f*iv*iv;
+	dvs[1] = 3.0f*iv*iv - 6.0f*v*iv;
+	dvs[2] = 6.0f*v*iv - 3.0f*v*v;
+	dvs[3] = 3.0f*v*v;
+	vec4 S(0.0f), Su(0.0f), Sv(0.0f);
+	for(int i = 0; i < 4; i++) {
+		vec4 P(0.0f), Pu(0.0f);
+		for(int j = 0; j < 4; j++) {
+			P += CVs[j+i*4].pos*us[j];
+			Pu += CVs[j+i*4].pos*dus[j];
+		}
+		S += P*vs[i];
+		Su += Pu*vs[i];
+		Sv += P*dvs[i];
+	}
+	*pos = vec3(S);
+	*du = vec3(Su);
+	*dv = vec3(Sv);
+}
+
+// at collapsed edges take the normal from just inside the patch
+vec3
+BezierSurface::EvalNormal(float u, float v)
+{
+	vec3 pos, du, dv, n;
+	EvalDerivs(u, v, &pos, &du, &dv);
+	if(NormalFromDerivs(du, dv, &n))
+		return n;
+	EvalDerivs(u + (0.5f-u)*0.002f, v + (0.5f-v)*0.002f, &pos, &du, &dv);
+	if(NormalFromDerivs(du, dv, &n))
+		return n;
+	return vec3(0.0f, 0.0f, 1.0f);
+}
+
 void
 BezierSurface::FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs)
 {
@@ -0,0 +1,9 @@
+#version 460
+
+layout(location = 0) in vec3 in_pos;
+
+// CVs go straight to the tessellation stages in object space
+void main()
+{
+	gl_Position = vec4(in_pos, 1.0);
+}
@@ -7,13 +7,16 @@
 #include <float.h>
 
 
-Curve::Curve(void) : degree(0), curveMesh(nil), hullMesh(nil), cvMesh(nil) {}
+Curve::Curve(void) : degree(0), curveMesh(nil), hullMesh(nil), cvMesh(nil), tessTolerance(0.0f), sampleTolerance(0.0f), editFirst(1<<30), editLast(-1),
+	lodLevel(-1), version(0), arcValid(false) {}
 
 Curve::~Curve(void)
 {
 	delete hullMesh;
 	delete curveMesh;
 	delete cvMesh;
+	for(int i = 0; i < MAX_LOD_LEVELS; i++)
+		delete lodCache[i].curveMesh;
 }
 
 void
@@ -41,13 +44,64 @@ Curve::DrawHull(bool active)
 	cvMesh->DrawVertices(active);
 }
 
+bool
+Curve::IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist)
+{
+	// might not have been drawn yet
+	if(!BoundOnRay(matrix, orig, dir))
+		return false;
+	Update();
+	return curveMesh->IntersectRay(matrix, orig, dir, dist);
+}
+
+bool
+Curve::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
+{
+	if(!BoundInFrustum(matrix, planes))
+		return false;
+	Update();
+	return curveMesh->IntersectFrustum(matrix, planes);
+}
+
+// The curve lies in the convex hull of its CVs
+void
+Curve::UpdateBound(void)
+{
+	if(!(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS)))
+		return;
+	boundBox.Init();
+	for(u32 i = 0; i < CVs.size(); i++)
+		boundBox.ContainPoint(vec3(CVs[i].pos)/CVs[i].pos.w);
+	boundSphere.FromBox(boundBox);
+}
+
 void
 Curve::Update(void)
 {
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS)) {
+		bezier.valid = false;
+		arcValid = false;
+		version++;
+		TrimCache();
+	}
+	UpdateBound();
 	UpdateCVs();
 	UpdateHull();
 	UpdateCurve();
+	curveMesh->boundBox = boundBox;
+	curveMesh->boundSphere = boundSphere;
 	dirty = 0;
+	editFirst = 1<<30;
+	editLast = -1;
+}
+
+void
+Curve::CVMoved(ControlVertex *cv)
+{
+	int i = (ControlVertex*)cv - &CVs[0];
+	editFirst = min(editFirst, i);
+	editLast = max(editLast, i);
+	dirty |= DIRTY_CVS;
 }
 
 void
@@ -117,7 +171,7 @@ Curve::UpdateCVs(void)
 	memcpy(verts, vertices, sizeof(vertices));
 	memcpy(inds, indices, sizeof(indices));
 
-	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, sizeof(Vertex), instData, numInst);
+	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, &iconVertexLayout, instData, numInst);
 }
 
 void
@@ -125,13 +179,13 @@ Curve::UpdateHull(void)
 {
 	int N = CVs.size();
 	int numIndices = 2*(N-1);
-	Vertex *verts;
+	LineVertex *verts;
 	u16 *indices;
-	if(dirty & DIRTY_POS || hullMesh == nil) {
+	if(dirty & (DIRTY_POS|DIRTY_CVS) || hullMesh == nil) {
 		if(hullMesh)
-			verts = (Vertex*)hullMesh->vertices;
+			verts = (LineVertex*)hullMesh->vertices;
 		else
-			verts = new Vertex[N];
+			verts = new LineVertex[N];
 
 		for(int i = 0; i < N; i++) {
 			verts[i].pos[0] = CVs[i].pos.x;
@@ -173,7 +227,7 @@ Curve::UpdateHull(void)
 	}
 
 	if(hullMesh == nil) {
-		hullMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, sizeof(Vertex));
+		hullMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, &lineVertexLayout);
 		hullMesh->submeshes[0].matID = MATID_HULL;
 		Mesh::Submesh sm;
 		sm.numIndices = 0;
@@ -182,55 +236,273 @@ Curve::UpdateHull(void)
 	}
 }
 
+// Chords may deviate at most curveTolerance from the curve in object space.
+// If pixelTolerance is non-zero, the screen space deviation in pixels
+// is used instead where that is coarser.
+float curveTolerance = 0.001f;
+float pixelTolerance = 0.5f;
+// place the samples of a span at even arc lengths
+bool evenCurveSamples = false;
+
+// Tolerance of the detail level for the current view, switches levels
+float
+Curve::Tolerance(void)
+{
+	float tol = curveTolerance;
+	if(pixelTolerance > 0.0f) {
+		mat4 matrix = node ? node->globalMatrix : mat4(1.0f);
+		if(tol > 0.0f) {
+			SwitchLevel(SelectLevel(DetailLevel(pixelTolerance, matrix, boundSphere, tol), lodLevel));
+			tol = LevelTolerance(lodLevel, tol);
+		} else
+			tol = PixelsToObject(pixelTolerance, matrix, boundSphere);
+	}
+	return tol;
+}
+
+// Keep the current tessellation in lodCache and use the one of level
+// if it was made from the current curve, otherwise it is redone.
 void
-Curve::UpdateCurve(void)
+Curve::SwitchLevel(int level)
 {
-//	if(!(dirty & DIRTY_POS))
-	if(!dirty)
+	if(level == lodLevel)
 		return;
-	assert(knots.size() == CVs.size() + degree + 1);
+	bool edited = dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS);
+	if(lodLevel >= 0) {
+		CurveLevel &old = lodCache[lodLevel];
+		std::swap(old.samples, samples);
+		std::swap(old.points, points);
+		std::swap(old.tessTolerance, tessTolerance);
+		std::swap(old.sampleTolerance, sampleTolerance);
+		std::swap(old.curveMesh, curveMesh);
+		old.version = edited ? -1 : version;
+	}
+	CurveLevel &l = lodCache[level];
+	bool valid = l.curveMesh && l.version == version && !edited;
+	std::swap(l.samples, samples);
+	std::swap(l.points, points);
+	std::swap(l.tessTolerance, tessTolerance);
+	std::swap(l.sampleTolerance, sampleTolerance);
+	std::swap(l.curveMesh, curveMesh);
+	l.version = -1;
+	lodLevel = level;
+	TrimCache();
+	// indices for the current selection
+	dirty |= DIRTY_SEL;
+	if(!valid)
+		tessTolerance = 0.0f;
+}
 
-	int N = 5 * (CVs.size() - degree) + 1;
-	Vertex *verts;
-	if(curveMesh)
-		verts = (Vertex*)curveMesh->vertices;
-	else
-		verts = new Vertex[N];
+// Free the cached levels made before an edit
+// and all but the neighbours of lodLevel
+void
+Curve::TrimCache(void)
+{
+	for(int i = 0; i < MAX_LOD_LEVELS; i++) {
+		CurveLevel &l = lodCache[i];
+		if(l.version == version && i >= lodLevel-1 && i <= lodLevel+1)
+			continue;
+		delete l.curveMesh;
+		l = CurveLevel();
+	}
+}
 
-	float minU = knots[0];
-	float maxU = knots[knots.size()-1];
-	float eps = 0.0001f;
-	for(int iu = 0; iu < N; iu++) {
-		float u = (float)iu/(N-1) * (minU+maxU) - minU;
-		u = clamp(u, minU, maxU-eps);
-		vec3 pos = Eval(u);
-		Vertex *vx = &verts[iu];
-		vx->pos[0] = pos.x;
-		vx->pos[1] = pos.y;
-		vx->pos[2] = pos.z;
-		vx->color[0] = 0;
-		vx->color[1] = 0;
-		vx->color[2] = 0;
-		vx->color[3] = 255;
+// distance of p from the segment a-b
+static float
+ChordDistance(vec3 a, vec3 b, vec3 p)
+{
+	vec3 ab = b - a;
+	float l = dot(ab, ab);
+	float t = l > 0.0f ? clamp(dot(p - a, ab)/l, 0.0f, 1.0f) : 0.0f;
+	return length(p - (a + t*ab));
+}
+
+// Append samples of spans [first,last] until the chords are within tol,
+// the start of the first span has to be there already.
+// Pieces are halved a level at a time, so the midpoints
+// of a level are evaluated in one batch.
+void
+Curve::TessellateSpans(int first, int last, float tol)
+{
+	std::vector<float> us, mids, nextUs;
+	std::vector<vec3> ps, midPoints, nextPs;
+	std::vector<u8> open, nextOpen;	// per piece, may still be split
+	for(int i = first; i <= last; i++) {
+		float u0 = knots[i];
+		float u1 = knots[i+1];
+		if(u0 == u1)
+			continue;
+		int start = samples.size();
+		// start with one piece per degree so a midpoint
+		// on the chord of an S-shaped span can't fool us
+		us.resize(degree+1);
+		ps.resize(degree+1);
+		for(int j = 0; j < degree; j++)
+			us[j] = u0 + (u1-u0)*j/degree;
+		us[degree] = u1;
+		ps[0] = points.back();
+		EvalBatch(&us[1], degree, &ps[1]);
+		open.assign(degree, true);
+		for(int depth = 0; depth < 8; depth++) {
+			mids.clear();
+			for(u32 j = 0; j < open.size(); j++)
+				if(open[j])
+					mids.push_back((us[j] + us[j+1])/2.0f);
+			if(mids.empty())
+				break;
+			midPoints.resize(mids.size());
+			EvalBatch(&mids[0], mids.size(), &midPoints[0]);
+			nextUs.assign(1, us[0]);
+			nextPs.assign(1, ps[0]);
+			nextOpen.clear();
+			int m = 0;
+			for(u32 j = 0; j < open.size(); j++) {
+				if(open[j]) {
+					bool split = ChordDistance(ps[j], ps[j+1], midPoints[m]) > tol;
+					if(split) {
+						nextUs.push_back(mids[m]);
+						nextPs.push_back(midPoints[m]);
+						nextOpen.push_back(true);
+					}
+					nextOpen.push_back(split);
+					m++;
+				} else
+					nextOpen.push_back(false);
+				nextUs.push_back(us[j+1]);
+				nextPs.push_back(ps[j+1]);
+			}
+			std::swap(us, nextUs);
+			std::swap(ps, nextPs);
+			std::swap(open, nextOpen);
+		}
+		samples.insert(samples.end(), us.begin()+1, us.end());
+		points.insert(points.end(), ps.begin()+1, ps.end());
+		if(evenCurveSamples) {
+			// as many samples but at even lengths,
+			// the arc length table has the knots
+			assert(arcValid);
+			int t = std::lower_bound(arcParams.begin(), arcParams.end(), u0) - arcParams.begin();
+			int end = std::lower_bound(arcParams.begin(), arcParams.end(), u1) - arcParams.begin();
+			assert(arcParams[t] == u0 && arcParams[end] == u1);
+			float l0 = arcLengths[t];
+			float len = arcLengths[end] - l0;
+			int k = samples.size() - start;
+			for(int j = 1; j < k; j++) {
+				float s = l0 + len*j/k;
+				while(t < end-1 && arcLengths[t+1] < s)
+					t++;
+				samples[start+j-1] = ParamInTable(arcParams, arcLengths, t, s);
+			}
+			if(k > 1)
+				EvalBatch(&samples[start], k-1, &points[start]);
+		}
+	}
+}
+
+void
+Curve::Tessellate(float tol)
+{
+	tessTolerance = tol;
+	// have to fit 16 bit indices
+	for(;;) {
+		samples.clear();
+		points.clear();
+		samples.push_back(knots[degree]);
+		points.push_back(Eval(knots[degree]));
+		TessellateSpans(degree, CVs.size()-1, tol);
+		if(samples.size() <= 0x10000)
+			break;
+		tol = tol > 0.0f ? tol*2.0f : boundSphere.radius*1e-5f;
+	}
+	sampleTolerance = tol;
+}
+
+// Redo only the spans around the moved CVs. Returns false if the
+// number of samples there changed, which needs a full update.
+bool
+Curve::RetessellateEdit(float tol)
+{
+	int first = max(editFirst, degree);
+	int last = min(editLast+degree, (int)CVs.size()-1);
+	// samples are sorted and always include the knots
+	int s0 = std::lower_bound(samples.begin(), samples.end(), knots[first]) - samples.begin();
+	int s1 = std::lower_bound(samples.begin(), samples.end(), knots[last+1]) - samples.begin();
+	std::vector<float> tailSamples(samples.begin()+s1+1, samples.end());
+	std::vector<vec3> tailPoints(points.begin()+s1+1, points.end());
+	samples.resize(s0+1);
+	points.resize(s0+1);
+	points[s0] = Eval(samples[s0]);
+	TessellateSpans(first, last, tol);
+	bool same = (int)samples.size() == s1+1;
+	samples.insert(samples.end(), tailSamples.begin(), tailSamples.end());
+	points.insert(points.end(), tailPoints.begin(), tailPoints.end());
+	if(same) {
+		LineVertex *verts = (LineVertex*)curveMesh->vertices;
+		for(int i = s0; i <= s1; i++) {
+			verts[i].pos[0] = points[i].x;
+			verts[i].pos[1] = points[i].y;
+			verts[i].pos[2] = points[i].z;
+		}
+		curveMesh->UpdateMesh(s0, s1-s0+1);
+	}
+	return same;
+}
+
+void
+Curve::UpdateCurve(void)
+{
+	float tol = Tolerance();
+	// view changes only matter when they change the detail level
+	bool retess = dirty & (DIRTY_POS|DIRTY_KNOTS) || curveMesh == nil ||
+		tol != tessTolerance;
+	bool rebuild = retess;
+	if(evenCurveSamples && (retess || dirty & DIRTY_CVS))
+		UpdateArcLength();
+	if(!retess && dirty & DIRTY_CVS) {
+		rebuild = !RetessellateEdit(sampleTolerance);
+		// the edit may have added too many samples
+		retess = samples.size() > 0x10000;
 	}
+	if(!rebuild && !(dirty & DIRTY_SEL))
+		return;
+	assert(knots.size() == CVs.size() + degree + 1);
 
+	if(retess)
+		Tessellate(tol);
+	int N = samples.size();
+	// Tessellate keeps this within 16 bit indices
+	assert(N <= 0x10000);
+	LineVertex *verts;
 	u16 *indices;
-	if(curveMesh)
+	if(curveMesh) {
+		if(rebuild)
+			curveMesh->Resize(N, 2*(N-1));
+		verts = (LineVertex*)curveMesh->vertices;
 		indices = curveMesh->indices;
-	else
+	} else {
+		verts = new LineVertex[N];
 		indices = new u16[2*(N-1)];
+	}
+
+	if(rebuild) {
+		for(int iu = 0; iu < N; iu++) {
+			LineVertex *vx = &verts[iu];
+			vx->pos[0] = points[iu].x;
+			vx->pos[1] = points[iu].y;
+			vx->pos[2] = points[iu].z;
+			vx->color[0] = 0;
+			vx->color[1] = 0;
+			vx->color[2] = 0;
+			vx->color[3] = 255;
+		}
+	}
+
 	int idx = 0;
 	int idxu = 2*(N-1);
 	for(int iu = 0; iu < N-1; iu++) {
-//		float u0 = (float)iu/(N-1) * (minU+maxU) - minU;
-		float u1 = (float)(iu+1)/(N-1) * (minU+maxU) - minU;
-//		int i0 = FindParam(u0);
-		int i1 = FindParam(u1);
-//		printf("%.3f %.3f | %d %d -> %d\n", u0, u1, i0, i1, activeSpans[i0] || activeSpans[i1]);
-
-		// this seems to be working
-		if(activeSpans[i1]) {
-//		if(activeSpans[i0] || activeSpans[i1]) {
+		// segments never cross knots
+		int span = FindParam((samples[iu] + samples[iu+1])/2.0f);
+		if(activeSpans[span]) {
 			indices[--idxu] = iu+1;
 			indices[--idxu] = iu;
 		} else {
@@ -238,18 +510,17 @@ Curve::UpdateCurve(void)
 			indices[idx++] = iu+1;
 		}
 	}
-//for(u32 i = 0; i < activeSpans.size(); i++) printf("%d ", activeSpans[i]);
-//printf(" | %d %d %d\n", idx, 2*(N-1)-idxu, 2*(N-1));
 
 	if(curveMesh) {
 		curveMesh->submeshes[0].numIndices = idx;
 		curveMesh->submeshes[1].numIndices = curveMesh->numIndices - idx;
-		curveMesh->UpdateMesh();
+		if(rebuild)
+			curveMesh->UpdateMesh();
 		curveMesh->UpdateIndices();
 		return;
 	}
 
-	curveMesh = CreateMesh(GL_LINES, N, verts, 2*(N-1), indices, sizeof(Vertex));
+	curveMesh = CreateMesh(GL_LINES, N, verts, 2*(N-1), indices, &lineVertexLayout);
 	curveMesh->submeshes[0].matID = MATID_WIRE;
 	Mesh::Submesh sm;
 	sm.numIndices = 0;
@@ -257,44 +528,216 @@ Curve::UpdateCurve(void)
 	curveMesh->submeshes.push_back(sm);
 }
 
-// a is always 0 in this case (or very close)
-float div(float a, float b) { return b == 0.0f ? 0.0f : a/b; }
+vec3
+Curve::Eval(float u)
+{
+	float N[MAX_DEGREE+1];
+	int span = FindSpan(u, degree, CVs.size(), &knots[0]);
+	EvalBasis(u, span, degree, &knots[0], N);
+	vec4 out(0.0f);
+	for(int i = 0; i <= degree; i++)
+		out += N[i] * CVs[span-degree+i].pos;
+	return vec3(out)/out.w;
+}
 
-// naive but known to work
-float
-evalBasis(float t, int i, int d, float *knots)
+void
+Curve::EvalDerivs(float u, vec3 *pos, vec3 *du)
 {
-	if(d == 0) {
-		if(knots[i] <= t && t < knots[i+1])
-			return 1.0f;
-		return 0.0f;
+	float N[MAX_DEGREE+1], dN[MAX_DEGREE+1];
+	int span = FindSpan(u, degree, CVs.size(), &knots[0]);
+	EvalBasisDerivs(u, span, degree, &knots[0], N, dN);
+	vec4 C(0.0f), Cu(0.0f);
+	for(int i = 0; i <= degree; i++) {
+		C += N[i] * CVs[span-degree+i].pos;
+		Cu += dN[i] * CVs[span-degree+i].pos;
 	}
-	float b0 = evalBasis(t, i, d-1, knots);
-	float b1 = evalBasis(t, i+1, d-1, knots);
-	// this way we're only dividing 0 by 0...should this ever become relevant
-	return div(b0*(t-knots[i]),     knots[i+d]-knots[i])
-	     + div(b1*(knots[i+d+1]-t), knots[i+d+1]-knots[i+1]);
-//	return b0*div(t-knots[i], knots[i+d]-knots[i]) + b1*div(knots[i+d+1]-t, knots[i+d+1]-knots[i+1]);
+	*pos = vec3(C)/C.w;
+	*du = (vec3(Cu) - *pos*Cu.w)/C.w;
 }
 
-vec3
-Curve::Eval(float u)
+void
+Curve::EvalBatch(const float *u, int n, vec3 *out)
 {
-	vec4 out(0.0f);
-	for(int i = 0; i < (int)CVs.size(); i++) {
-		float x = evalBasis(u, i, degree, &knots[0]);
-		out += x * CVs[i].pos;
-	}
-	return vec3(out)/out.w;
+	EvalCurveBatch(&CVs[0].pos, sizeof(ControlVertex), degree, CVs.size(), &knots[0],
+		u, n, out, sizeof(vec3));
 }
 
 int
 Curve::FindParam(float u)
 {
-	for(u32 i = 0; i < knots.size()-1; i++)
-		if(knots[i] <= u && u <= knots[i+1])
-			return i;
-	return -1;
+	return FindInterval(u, knots.size(), &knots[0]);
+}
+
+// Bezier segments, kept until CVs or knots change
+const BezierForm&
+Curve::GetBezierForm(void)
+{
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS))
+		bezier.valid = false;
+	if(!bezier.valid) {
+		bezier.FromCurve(&CVs[0].pos, sizeof(ControlVertex), degree, CVs.size(), &knots[0]);
+		bezier.valid = true;
+	}
+	return bezier;
+}
+
+// Closest point to p in object space and its parameter
+vec3
+Curve::Project(vec3 p, float *u)
+{
+	vec3 out;
+	ProjectBatch(&p, 1, u, &out);
+	return out;
+}
+
+// Each closest point bounds the search for the next one,
+// so points along a path go much faster than scattered ones
+void
+Curve::ProjectBatch(const vec3 *points, int n, float *u, vec3 *out)
+{
+	const BezierForm &bz = GetBezierForm();
+	float v;
+	for(int i = 0; i < n; i++) {
+		float d = i > 0 ? glm::distance2(points[i], out[i-1]) : FLT_MAX;
+		if(bz.Project(points[i], d, u[i], v, out[i]))
+			continue;
+		// the previous point is closest,
+		// or there is nothing to go by (no spans, p not finite)
+		if(i > 0) {
+			u[i] = u[i-1];
+			out[i] = out[i-1];
+		} else {
+			u[i] = knots[degree];
+			out[i] = Eval(u[i]);
+		}
+	}
+}
+
+// relative error of the pieces of the arc length table
+float arcTolerance = 1e-5f;
+
+// Length of [u0,u1] by 5 point Gauss-Legendre quadrature
+float
+Curve::ArcLength(float u0, float u1)
+{
+	static const float x[5] = { 0.0f, -0.5384693f, 0.5384693f, -0.9061798f, 0.9061798f };
+	static const float w[5] = { 0.5688889f, 0.4786287f, 0.4786287f, 0.2369269f, 0.2369269f };
+	float h = (u1 - u0)/2.0f;
+	float m = (u1 + u0)/2.0f;
+	float len = 0.0f;
+	for(int i = 0; i < 5; i++) {
+		vec3 pos, du;
+		EvalDerivs(m + h*x[i], &pos, &du);
+		len += w[i]*glm::length(du);
+	}
+	return len*h;
+}
+
+// Append the end of [u0,u1] of length len to the table,
+// halving it until the halves add up to the whole
+void
+Curve::ArcSubdivide(float u0, float u1, float len, int depth,
+	std::vector<float> &params, std::vector<float> &lengths)
+{
+	float um = (u0 + u1)/2.0f;
+	float l0 = ArcLength(u0, um);
+	float l1 = ArcLength(um, u1);
+	if(depth > 0 && fabsf(l0 + l1 - len) > arcTolerance*(l0 + l1)) {
+		ArcSubdivide(u0, um, l0, depth-1, params, lengths);
+		ArcSubdivide(um, u1, l1, depth-1, params, lengths);
+	} else {
+		params.push_back(u1);
+		lengths.push_back(lengths.back() + l0 + l1);
+	}
+}
+
+// Parameter at length s inside piece i of a table, by Newton iteration
+// from linear interpolation, the pieces are smooth enough for that
+float
+Curve::ParamInTable(const std::vector<float> &params, const std::vector<float> &lengths, int i, float s)
+{
+	float u0 = params[i];
+	float u1 = params[i+1];
+	float s0 = lengths[i];
+	float s1 = lengths[i+1];
+	float u = s1 > s0 ? u0 + (u1-u0)*(s-s0)/(s1-s0) : u0;
+	for(int it = 0; it < 4; it++) {
+		vec3 pos, du;
+		EvalDerivs(u, &pos, &du);
+		float speed = glm::length(du);
+		if(speed == 0.0f)
+			break;
+		u = clamp(u - (s0 + ArcLength(u0, u) - s)/speed, u0, u1);
+	}
+	return u;
+}
+
+// Arc length table, kept until CVs or knots change
+void
+Curve::UpdateArcLength(void)
+{
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS))
+		arcValid = false;
+	if(arcValid)
+		return;
+	arcParams.assign(1, knots[degree]);
+	arcLengths.assign(1, 0.0f);
+	for(u32 i = degree; i < CVs.size(); i++)
+		if(knots[i] < knots[i+1])
+			ArcSubdivide(knots[i], knots[i+1], ArcLength(knots[i], knots[i+1]), 12,
+				arcParams, arcLengths);
+	arcValid = true;
+}
+
+float
+Curve::Length(void)
+{
+	UpdateArcLength();
+	return arcLengths.back();
+}
+
+float
+Curve::LengthAt(float u)
+{
+	UpdateArcLength();
+	if(arcParams.size() < 2)
+		return 0.0f;
+	u = clamp(u, arcParams.front(), arcParams.back());
+	int i = std::upper_bound(arcParams.begin(), arcParams.end(), u) - arcParams.begin() - 1;
+	i = clamp(i, 0, (int)arcParams.size()-2);
+	return arcLengths[i] + ArcLength(arcParams[i], u);
+}
+
+float
+Curve::ParamAtLength(float s)
+{
+	UpdateArcLength();
+	if(arcParams.size() < 2)
+		return knots[degree];
+	s = clamp(s, 0.0f, arcLengths.back());
+	int i = std::upper_bound(arcLengths.begin(), arcLengths.end(), s) - arcLengths.begin() - 1;
+	i = clamp(i, 0, (int)arcParams.size()-2);
+	return ParamInTable(arcParams, arcLengths, i, s);
+}
+
+// n parameters at even lengths from start to end
+void
+Curve::SampleByLength(int n, float *u)
+{
+	UpdateArcLength();
+	if(arcParams.size() < 2 || n < 2) {
+		for(int k = 0; k < n; k++)
+			u[k] = knots[degree];
+		return;
+	}
+	int i = 0;
+	for(int k = 0; k < n; k++) {
+		float s = arcLengths.back()*k/(n-1);
+		while(i < (int)arcParams.size()-2 && arcLengths[i+1] < s)
+			i++;
+		u[k] = ParamInTable(arcParams, arcLengths, i, s);
+	}
+	u[n-1] = arcParams.back();
 }
 
 void
@@ -311,6 +754,35 @@ Curve::FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickab
 
 }
 
+// Curve through the points, parameterized by chord length or centripetal.
+// The degree is lowered if there are too few points.
+Curve*
+InterpolateCurve(const vec3 *points, int n, int degree, bool centripetal)
+{
+	if(n < 2)
+		return nil;
+	int p = min(degree, n-1);
+	std::vector<vec4> pts(n);
+	for(int i = 0; i < n; i++)
+		pts[i] = vec4(points[i], 1.0f);
+	std::vector<float> params(n);
+	InterpParams(&pts[0], sizeof(vec4), n, centripetal, &params[0]);
+
+	Curve *curve = new Curve;
+	curve->degree = p;
+	curve->knots.resize(n+p+1);
+	AveragedKnots(&params[0], n, p, &curve->knots[0]);
+	curve->CVs.resize(n);
+	for(int i = 0; i < n; i++)
+		curve->CVs[i].parent = curve;
+	if(!SolveCollocation(&params[0], n, p, &curve->knots[0], &pts[0], sizeof(vec4),
+	   &curve->CVs[0].pos, sizeof(ControlVertex))) {
+		delete curve;
+		return nil;
+	}
+	return curve;
+}
+
 Node*
 CreateTestCurve(void)
 {
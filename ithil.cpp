@@ -62,14 +62,19 @@ compileshader(GLenum type, const char *src)
 	return shader;
 }
 
+// tcs and tes are optional
 GLint
-linkprogram(GLint vs, GLint fs)
+linkprogram(GLint vs, GLint tcs, GLint tes, GLint fs)
 {
 	GLint program, success;
 
 	program = glCreateProgram();
 
 	glAttachShader(program, vs);
+	if(tcs >= 0)
+		glAttachShader(program, tcs);
+	if(tes >= 0)
+		glAttachShader(program, tes);
 	glAttachShader(program, fs);
 	glLinkProgram(program);
 	glGetProgramiv(program, GL_LINK_STATUS, &success);
@@ -81,6 +86,31 @@ linkprogram(GLint vs, GLint fs)
 	return program;
 }
 
+GLint
+linkprogram(GLint vs, GLint fs)
+{
+	return linkprogram(vs, -1, -1, fs);
+}
+
+GLint
+linkcomputeprogram(GLint cs)
+{
+	GLint program, success;
+
+	if(cs < 0)
+		return -1;
+	program = glCreateProgram();
+	glAttachShader(program, cs);
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if(!success){
+		fprintf(stderr, "glLinkProgram:");
+		printlog(program);
+		return -1;
+	}
+	return program;
+}
+
 
 void
 InitGL(void *loadproc)
@@ -140,7 +170,7 @@ Lighting lighting;
 Lighting defLighting;
 
 Program *curProg;
-Program defProg, cvProg;
+Program defProg, cvProg, tessProg, nurbsProg;
 
 void
 Program::Use(void)
@@ -156,6 +186,7 @@ mat4 unpv;
 mat4 worldMat;
 mat4 normalMat;
 vec3 eyePos;
+vec4 viewPlanes[6];	// frustum of pv
 
 void
 SetCamera(void)
@@ -187,9 +218,12 @@ SetMaterial(const Material &mat)
 	glUniform1f(curProg->u_matShininess, mat.shininess);
 }
 
+Lighting curLighting;
+
 void
 SetLighting(const Lighting &lighting)
 {
+	curLighting = lighting;
 	glUniform4fv(curProg->u_ambient, 1, value_ptr(lighting.globalAmbient));
 	glUniform4fv(curProg->u_lightDiffuse, 1, value_ptr(lighting.diffuse));
 	glUniform4fv(curProg->u_lightSpecular, 1, value_ptr(lighting.specular));
@@ -200,6 +234,10 @@ SetLighting(const Lighting &lighting)
 #include "inc/shader.frag.inc"
 #include "inc/cv.vert.inc"
 #include "inc/tex.frag.inc"
+#include "inc/bezier.vert.inc"
+#include "inc/bezier.tesc.inc"
+#include "inc/bezier.tese.inc"
+#include "inc/nurbs.comp.inc"
 #include "inc/icons.png.inc"
 
 Texture *CreateTexture(u8 *data, u32 size)
@@ -239,9 +277,20 @@ InitScene(void)
 	vs = compileshader(GL_VERTEX_SHADER, cv_vert_src);
 	fs = compileshader(GL_FRAGMENT_SHADER, tex_frag_src);
 	cvProg.program = linkprogram(vs, fs);
+	vs = compileshader(GL_VERTEX_SHADER, bezier_vert_src);
+	GLint tcs = compileshader(GL_TESS_CONTROL_SHADER, bezier_tesc_src);
+	GLint tes = compileshader(GL_TESS_EVALUATION_SHADER, bezier_tese_src);
+	fs = compileshader(GL_FRAGMENT_SHADER, shader_frag_src);
+	if(tcs >= 0 && tes >= 0)
+		tessProg.program = linkprogram(vs, tcs, tes, fs);
+	else
+		tessProg.program = -1;
+	nurbsProg.program = linkcomputeprogram(compileshader(GL_COMPUTE_SHADER, nurbs_comp_src));
 
 #define X(uniform) defProg.uniform = glGetUniformLocation(defProg.program, #uniform); \
-                   cvProg.uniform = glGetUniformLocation(cvProg.program, #uniform);
+                   cvProg.uniform = glGetUniformLocation(cvProg.program, #uniform); \
+                   tessProg.uniform = glGetUniformLocation(tessProg.program, #uniform); \
+                   nurbsProg.uniform = glGetUniformLocation(nurbsProg.program, #uniform);
 	UNIFORMS
 #undef X
 
@@ -354,6 +403,11 @@ InitScene(void)
 
 	node = CreateTestSurface();
 	sceneRoot->AddChild(node);
+
+	node = CreateTestLoft();
+	node->visible = false;
+	node->isTreeOpen = false;
+	sceneRoot->AddChild(node);
 }
 
 std::list<Pickable*> selection;
@@ -478,6 +532,9 @@ DrawNode(Node *node)
 {
 	if(node->mesh == nil)
 		return;
+	// before anything is drawn, so hidden objects are not tessellated
+	if(!node->mesh->BoundInFrustum(node->globalMatrix, viewPlanes))
+		return;
 
 	SetWorldMatrix(node->globalMatrix);
 
@@ -529,6 +586,7 @@ RenderScene(void)
 {
 	mat4 world;
 
+	frameNumber++;
 	sceneRoot->UpdateMatrices();
 
 	camera.m_aspectRatio = (float)display_w/display_h;
@@ -541,6 +599,7 @@ RenderScene(void)
 	pv = proj*view;
 	unpv = glm::inverse(pv);
 	eyePos = camera.m_position;
+	FrustumPlanes(pv, viewPlanes);
 
 	glEnable(GL_DEPTH_TEST);
 
@@ -656,12 +715,41 @@ TransformPanel(mat4 &matrix)
 	}
 }
 
+// Arc length of a curve, and a copy through points at even lengths
+void
+CurvePanel(Node *node, Curve *curve)
+{
+	static float at = 0.0f;
+	static int numPoints = 20;
+	float len = curve->Length();
+	ImGui::Text("length %g", len);
+	ImGui::SliderFloat("at length", &at, 0.0f, len);
+	float u = curve->ParamAtLength(at);
+	ImGui::Text("u %g, length there %g", u, curve->LengthAt(u));
+	ImGui::InputInt("points", &numPoints);
+	if(ImGui::Button("Copy at even lengths") && numPoints >= 2 && node->parent) {
+		std::vector<float> params(numPoints);
+		std::vector<vec3> points(numPoints);
+		curve->SampleByLength(numPoints, &params[0]);
+		for(int i = 0; i < numPoints; i++)
+			points[i] = curve->Eval(params[i]);
+		Curve *copy = InterpolateCurve(&points[0], numPoints, curve->degree, false);
+		if(copy) {
+			Node *n = new Node("evenCopy");
+			n->AttachMesh(copy);
+			n->localMatrix = node->localMatrix;
+			node->parent->AddChild(n);
+		}
+	}
+}
+
 bool showHierarchyWindow = true;
 bool showMaterialWindow = false;
 bool showDemoWindow = false;
 
 
 int dragging;
+int frameNumber;	// counts rendered frames
 bool startDragging;
 bool stopDragging;
 bool dragCtrl;
@@ -1328,6 +1416,9 @@ ControlWindow()
 		AlMenuEntry("Toggle Model", nil, &renderModel);
 		AlMenuEntry("Toggle Shade", nil, &renderShade);
 		AlMenuEntry("Toggle Hull", nil, &renderHull);
+		AlMenuEntry("GPU Tessellation", nil, &gpuTessellation);
+		AlMenuEntry("GPU NURBS", nil, &computeTessellation);
+		AlMenuEntry("Async Tessellation", nil, &asyncTessellation);
 		EndAlMenu();
 	}
 
@@ -1459,6 +1550,9 @@ GUI(void)
 					TransformPanel(node->localMatrix);
 					node->UpdateMatrices();
 				}
+				Curve *curve = dynamic_cast<Curve*>(node->mesh);
+				if(curve)
+					CurvePanel(node, curve);
 			}
 		}
 
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <vector>
+#include <atomic>
 
 #define PI M_PI
 #define TAU (2.0f*PI)
@@ -46,6 +47,7 @@ using glm::normalize;
 using glm::value_ptr;
 
 extern int dragging;
+extern int frameNumber;
 extern bool startDragging, stopDragging;
 extern bool dragCtrl, dragShift, dragAlt;
 extern vec2 dragStart, dragEnd, dragDelta;
@@ -76,6 +78,7 @@ struct Sphere;
 struct Box;
 struct Node;
 struct Drawable;
+struct ControlVertex;
 
 struct Sphere
 {
@@ -95,6 +98,16 @@ struct Box
 };
 
 bool IsPointInFrustum(vec3 point, const vec4 *planes);
+bool IsSphereInFrustum(const Sphere &sphere, const vec4 *planes);
+enum {
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECT,
+	FRUSTUM_INSIDE
+};
+int BoxInFrustum(const Box &box, const vec4 *planes);
+bool IsSphereOnRay(const Sphere &sphere, vec3 orig, vec3 dir);
+bool RayHitsBox(const Box &box, vec3 orig, vec3 invDir, float tmax, float *tnear = nil);
+void FrustumPlanes(const mat4 &m, vec4 *planes);
 
 struct Pickable
 {
@@ -147,7 +160,10 @@ extern Texture *iconsTex;
 
 enum {
 	DIRTY_SEL = 1,
-	DIRTY_POS = 2
+	DIRTY_POS = 2,
+	DIRTY_KNOTS = 4,	// implies DIRTY_POS
+	DIRTY_TESS = 8,		// tessellation density changed
+	DIRTY_CVS = 16		// only the CVs passed to CVMoved
 };
 
 struct Drawable
@@ -158,11 +174,16 @@ struct Drawable
 	int dirty;
 	Node *node;	// not always set, but currently needed for xforming components
 
-	Drawable(void) : dirty(DIRTY_SEL|DIRTY_POS), node(nil) {}
+	Drawable(void) : dirty(DIRTY_SEL|DIRTY_POS|DIRTY_KNOTS), node(nil) {}
 	virtual ~Drawable(void) {}
 	virtual void DrawWire(bool active) = 0;
 	virtual void DrawShaded(void) = 0;
 	virtual void DrawHull(bool active) {}
+	virtual void CVMoved(ControlVertex *cv) { dirty |= DIRTY_POS; }
+	// bounds without tessellating, so culling and picking can come first
+	virtual void UpdateBound(void) {}
+	bool BoundInFrustum(const mat4 &matrix, const vec4 *planes);
+	bool BoundOnRay(const mat4 &matrix, vec3 orig, vec3 dir);
 
 	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist) = 0;
 	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes) = 0;
@@ -201,13 +222,58 @@ struct Lighting
 	vec3 direction;
 };
 
-// this is kinda dumb
+// Everything, for Bezier patches and the CV icons.
+// All formats start with the position.
 struct Vertex {
 	float pos[3];
 	unsigned char color[4];
 	float normal[3];
 	float uv[2];
 };
+// wires, hulls and curves
+struct LineVertex {
+	float pos[3];
+	unsigned char color[4];
+};
+// shaded polygons and tessellated surfaces
+struct PackedVertex {
+	float pos[3];
+	unsigned char color[4];
+	u32 normal;	// 2:10:10:10 signed normalized
+	u16 uv[2];	// half floats
+};
+u32 PackNormal(vec3 n);
+u16 PackHalf(float f);
+
+// how the attributes of a vertex format are fed to the shaders
+struct VertexAttrib {
+	u32 location;
+	u32 size;
+	u32 type;
+	bool normalized;
+	u32 offset;
+};
+struct VertexLayout {
+	u32 stride;
+	int numAttribs;
+	VertexAttrib attribs[4];
+};
+extern const VertexLayout vertexLayout;
+extern const VertexLayout iconVertexLayout;
+extern const VertexLayout lineVertexLayout;
+extern const VertexLayout packedVertexLayout;
+
+// Triangles for picking as a vertex and two edges, one per SIMD lane
+#ifdef __AVX__
+#define TRI_BLOCK 8
+#else
+#define TRI_BLOCK 4
+#endif
+struct TriBlock {
+	float v0[3][TRI_BLOCK];
+	float e1[3][TRI_BLOCK];
+	float e2[3][TRI_BLOCK];
+};
 
 struct Mesh : public Drawable
 {
@@ -215,19 +281,41 @@ struct Mesh : public Drawable
 	u32 numVertices;
 	void *vertices;
 	u32 numIndices;
-	u16 *indices;
+	union {
+		u16 *indices;
+		u32 *indices32;	// with wideIndices
+	};
+	bool wideIndices;	// more than 0x10000 vertices
+	bool chunked;		// indices are relative to the submesh's baseVertex
+	const VertexLayout *layout;
 	u32 stride;
 	struct Submesh {
 		u32 numIndices;
 		u32 firstIndex;
 		i32 matID;
+		u32 baseVertex;
+
+		Submesh(void) : numIndices(0), firstIndex(0), matID(MATID_DEFAULT), baseVertex(0) {}
 	};
 	std::vector<Submesh> submeshes;
 
+	u32 maxVertices, maxIndices;	// allocated storage
+
 	u32 vao;
 	u32 vbo, ibo;
 
-	Mesh(void) : vao(0), vbo(0), ibo(0) {}
+	// hierarchy over the triangles for picking
+	struct BVHNode {
+		Box box;
+		u32 first;	// first of bvhTris in a leaf, else second child
+		u32 count;	// 0 for inner nodes, first child follows
+	};
+	std::vector<BVHNode> bvh;
+	std::vector<u32> bvhTris;	// leaves padded to whole blocks
+	std::vector<TriBlock> bvhBlocks;
+	bool bvhStale;	// vertices moved since the last refit
+
+	Mesh(void) : wideIndices(false), chunked(false), maxVertices(0), maxIndices(0), vao(0), vbo(0), ibo(0), bvhStale(false) {}
 	virtual ~Mesh(void);
 	virtual void DrawWire(bool active);
 	virtual void DrawShaded(void);
@@ -238,11 +326,38 @@ struct Mesh : public Drawable
 	virtual void FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs) {};
 
 	vec3 GetVertex(int i) { return *(vec3*)((u8*)vertices + i*stride); }
+	u32 IndexSize(void) { return wideIndices ? sizeof(u32) : sizeof(u16); }
+	u32 IndexType(void);
+	u32 ChunkBase(u32 i);
+	// vertex of index i
+	u32 GetIndex(u32 i) {
+		u32 idx = wideIndices ? indices32[i] : indices[i];
+		return chunked ? idx + ChunkBase(i) : idx;
+	}
+	void SetIndex(u32 i, u32 idx) {
+		if(wideIndices)
+			indices32[i] = idx;
+		else
+			indices[i] = idx;
+	}
+	void DrawElements(u32 count, u32 first, u32 baseVertex);
 
 	void UpdateMesh(void);
+	void UpdateMesh(u32 first, u32 count);
 	void UpdateIndices(void);
+	void Resize(u32 numVertices, u32 numIndices);
+
+	void TriangleBox(u32 t, Box &box);
+	void FillBlock(u32 b);
+	void BuildBVHNode(u32 first, u32 count, const Box *triBoxes, int depth);
+	void BuildBVH(void);
+	void RefitBVH(void);
+	void UpdateBVH(void);
 };
-Mesh *CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, u32 stride);
+Mesh *CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, const VertexLayout *layout);
+Mesh *CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u32 *indices, const VertexLayout *layout);
+Mesh *CreateChunkedMesh(u32 primType, u32 numVertices, const void *vertices, u32 numIndices, const u32 *indices, const VertexLayout *layout,
+	const std::vector<Mesh::Submesh> &submeshes, std::vector<u32> &vertexMap);
 
 struct InstData {
 	vec4 pos_sel;
@@ -254,9 +369,11 @@ struct VertexMesh : public Mesh
 	u32 numInst;
 
 	void UpdateInstanceData(void);
+	void UpdateInstanceData(u32 first, u32 count);
 	void DrawVertices(bool active);
 };
-VertexMesh *CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, u32 stride, InstData *instData, u32 nInst);
+VertexMesh *CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, const VertexLayout *layout, InstData *instData, u32 nInst);
+VertexMesh *CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u32 *indices, const VertexLayout *layout, InstData *instData, u32 nInst);
 
 Mesh *CreateCube(void);
 Mesh *CreateSphere(float r);
@@ -308,56 +425,190 @@ struct Polyset : public Drawable
 	int numEdges;		// need to generate wire once to know this
 	int maxVertsEdges;	// sum of all edges/vertices per polygon, many doubles
 	Mesh *shadedMesh;
+	std::vector<u32> shadedMap;	// uniqueVertices of a chunked shadedMesh
 	Mesh *wireMesh;
 	VertexMesh *cvMesh;
+	std::vector<Polyset*> lods;	// simplified versions, lods[i] for level i+1
+	int lodLevel;
 
 	Polyset(void);
 	virtual void DrawWire(bool active);
 	virtual void DrawShaded(void);
 	virtual void DrawHull(bool active);
-	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist) { return shadedMesh->IntersectRay(matrix, orig, dir, dist); }
-	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes) { return shadedMesh->IntersectFrustum(matrix, planes); }
+	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist);
+	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes);
 	virtual void FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs);
+	virtual void UpdateBound(void);
 	void UpdateCVs(void);
+	template <typename T> int WireIndices(T *indices, int size, int *numUnsel);
 	void UpdateWire(void);
 	void UpdateShaded(void);
 	void Update(void);
+	Polyset *LevelToDraw(void);
 };
+extern float polysetLodRadius;
+extern bool chunkLargeMeshes;
 Polyset *ReadObjFile(FILE *f);
 Polyset *ReadObjFile(const char *path);
 Node *ReadDffFile(const char *path);
 
 
 
+// work done on the worker thread, owned by whoever queued it
+// until it is done or abandoned
+enum {
+	JOB_QUEUED,
+	JOB_DONE,
+	JOB_ABANDONED
+};
+struct Job
+{
+	std::atomic<int> state;
+
+	Job(void) : state(JOB_QUEUED) {}
+	virtual ~Job(void) {}
+	virtual void Run(void) = 0;
+	bool Done(void) { return state == JOB_DONE; }
+	bool Abandoned(void) { return state == JOB_ABANDONED; }
+};
+void QueueJob(Job *job);
+void AbandonJob(Job *job);
+
+
+#define MAX_DEGREE 7
+#define MAX_SEGMENTS 32	// per span or patch edge
+#define MAX_LOD_LEVELS 16
+
+int FindSpan(float u, int degree, int numCVs, const float *knots);
+void EvalBasis(float u, int span, int degree, const float *knots, float *N);
+void EvalBasisDerivs(float u, int span, int degree, const float *knots, float *N, float *dN);
+int FindInterval(float u, int numKnots, const float *knots);
+bool NormalFromDerivs(vec3 du, vec3 dv, vec3 *n);
+float PixelsToObject(float pixels, const mat4 &matrix, const Sphere &sphere);
+int SegmentsForTolerance(float K, float tol);
+float DetailLevel(float pixels, const mat4 &matrix, const Sphere &sphere, float base);
+int SelectLevel(float x, int current);
+inline float LevelTolerance(int level, float base) { return ldexpf(base, level); }
+extern float lodHysteresis;
+
+// non-zero basis functions and derivatives at a fixed set of parameters
+struct BasisTable
+{
+	int degree;
+	int numSamples;
+	std::vector<float> params;
+	std::vector<int> spans;
+	std::vector<float> basis;	// degree+1 per sample
+	std::vector<float> derivs;	// degree+1 per sample
+
+	BasisTable(void) : degree(0), numSamples(0) {}
+	void Build(const float *u, int n, int degree, int numCVs, const float *knots);
+	void BuildUniform(int n, int degree, int numCVs, const float *knots);
+	void FindSamples(float u0, float u1, int *first, int *end) const;
+	const float *Basis(int i) const { return &basis[i*(degree+1)]; }
+	const float *Derivs(int i) const { return &derivs[i*(degree+1)]; }
+};
+
+void EvalCurveBatch(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots,
+	const float *u, int n, vec3 *out, u32 outStride);
+void EvalSurfaceGridRange(const vec4 *cvs, u32 cvStride, int numU, const BasisTable &tu, const BasisTable &tv,
+	vec3 *pos, u32 *normals, u32 strideU, u32 strideV, std::vector<float> &scratch,
+	int u0, int u1, int v0, int v1);
+int InsertKnot(float u, int r, int degree, int numCVs, const float *knots, const vec4 *cvs, u32 cvStride,
+	float *newKnots, vec4 *newCVs, u32 newStride);
+int CountSegments(int degree, int numCVs, const float *knots, float *breaks);
+int DecomposeCurve(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots,
+	vec4 *out, u32 outStride);
+void InterpParams(const vec4 *pts, u32 stride, int n, bool centripetal, float *params);
+void AveragedKnots(const float *params, int n, int degree, float *knots);
+bool SolveCollocation(const float *params, int n, int degree, const float *knots,
+	const vec4 *rhs, u32 rhsStride, vec4 *x, u32 xStride);
+bool IntersectRayPatch(const vec4 *cvs, u32 cvStride, int width, int p, int q, vec3 orig, vec3 dir,
+	float &t, float &s, float &u);
+
+// Bezier segments (degreeV 0) or patches of a NURBS
+struct BezierForm
+{
+	int degreeU, degreeV;
+	int numU, numV;	// segments in each direction
+	std::vector<float> breaksU, breaksV;	// numU+1 and numV+1 parameters
+	std::vector<vec4> CVs;	// homogeneous, Width() x Height()
+	struct Bound
+	{
+		Box box;	// of the CVs
+		int su0, sv0, su1, sv1;	// patches inside
+		int child[2];	// -1 for a single patch
+	};
+	std::vector<Bound> bounds;	// hierarchy over the patches, 0 is the root
+	bool valid;
+
+	BezierForm(void) : degreeU(0), degreeV(0), numU(0), numV(0), valid(false) {}
+	void FromCurve(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots);
+	void FromSurface(const vec4 *cvs, u32 cvStride, int degreeU, int degreeV, int numCVsU, int numCVsV,
+		const float *knotsU, const float *knotsV);
+	int Width(void) const { return numU*(degreeU+1); }
+	int Height(void) const { return numV*(degreeV+1); }
+	// first CV of a segment or patch, rows are Width() apart
+	const vec4 *Patch(int su, int sv) const { return &CVs[sv*(degreeV+1)*Width() + su*(degreeU+1)]; }
+	int BuildBounds(int su0, int sv0, int su1, int sv1);
+	bool IntersectRay(vec3 orig, vec3 dir, float &t, float &u, float &v) const;
+	bool Project(vec3 pt, float &dist2, float &u, float &v, vec3 &closest) const;
+};
 
 struct BezierSurface;
 
 struct BezierSurface : public Drawable
 {
 	ControlVertex CVs[4*4];
-	Mesh *surfaceMesh;
+	Mesh *surfaceMesh;	// built lazily with gpuTessellation
+	Mesh *patchMesh;	// CVs as GL_PATCHES
 	Mesh *curveMesh;
 	Mesh *hullMesh;
 	VertexMesh *cvMesh;
 	int matID;
+	int edgeSegs[4];	// along v=0, u=1, v=1, u=0
+	int segsU, segsV;	// interior
+	int surfDirty;	// dirty flags not yet applied to surfaceMesh
 
 	virtual ~BezierSurface(void);
 	virtual void DrawWire(bool active);
 	virtual void DrawShaded(void);
 	virtual void DrawHull(bool active);
-	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist) { return surfaceMesh->IntersectRay(matrix, orig, dir, dist); }
-	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes) { return surfaceMesh->IntersectFrustum(matrix, planes); }
+	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist);
+	bool IntersectRayUV(const mat4 &matrix, vec3 orig, vec3 dir, float &dist, float &u, float &v);
+	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes);
 	virtual void FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs);
+	virtual void UpdateBound(void);
 	void UpdateHull(void);
 	void UpdateCVs(void);
 	void UpdateCurve(void);
 	void UpdateSurf(void);
+	void UpdateTessellation(void);
+	void UpdateSurfaceMesh(void);
+	void UpdatePatch(void);
 	void Update(void);
 
 	vec3 Eval(float u, float v);
+	void EvalDerivs(float u, float v, vec3 *pos, vec3 *du, vec3 *dv);
+	vec3 EvalNormal(float u, float v);
 };
 Node *CreateTeapot(void);
+extern bool gpuTessellation;
+extern float tessPixels;
+
+
+// tessellation of a Curve at one detail level
+struct CurveLevel
+{
+	std::vector<float> samples;
+	std::vector<vec3> points;
+	float tessTolerance;
+	float sampleTolerance;
+	Mesh *curveMesh;
+	int version;	// of the curve it was made from, -1 if none
 
+	CurveLevel(void) : tessTolerance(0.0f), sampleTolerance(0.0f), curveMesh(nil), version(-1) {}
+};
 
 struct Curve : public Drawable
 {
@@ -368,24 +619,88 @@ struct Curve : public Drawable
 	Mesh *hullMesh;
 	VertexMesh *cvMesh;
 	std::vector<u8> activeSpans;
+	std::vector<float> samples;	// tessellation parameters
+	std::vector<vec3> points;	// and positions
+	float tessTolerance;	// what samples were made for
+	float sampleTolerance;	// and with, coarser if they didn't fit 16 bit indices
+	int editFirst, editLast;	// CVs moved since last update
+	BezierForm bezier;	// cached by GetBezierForm
+	int lodLevel;	// -1 before the first tessellation
+	int version;	// counts changes of the curve, for lodCache
+	CurveLevel lodCache[MAX_LOD_LEVELS];
+	std::vector<float> arcParams;	// arc length table, increasing parameters
+	std::vector<float> arcLengths;	// and the length up to each
+	bool arcValid;
 
 	Curve(void);
 	virtual ~Curve(void);
 	virtual void DrawWire(bool active);
 	virtual void DrawShaded(void) {}
 	virtual void DrawHull(bool active);
-	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist) { return curveMesh->IntersectRay(matrix, orig, dir, dist); }
-	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes) { return curveMesh->IntersectFrustum(matrix, planes); }
+	virtual void CVMoved(ControlVertex *cv);
+	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist);
+	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes);
 	virtual void FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs);
+	virtual void UpdateBound(void);
 	void UpdateHull(void);
 	void UpdateCVs(void);
 	void UpdateCurve(void);
 	void Update(void);
+	float Tolerance(void);
+	void SwitchLevel(int level);
+	void TrimCache(void);
+	void Tessellate(float tol);
+	void TessellateSpans(int first, int last, float tol);
+	bool RetessellateEdit(float tol);
 
 	vec3 Eval(float u);
+	void EvalDerivs(float u, vec3 *pos, vec3 *du);
+	void EvalBatch(const float *u, int n, vec3 *out);
 	int FindParam(float u);
+	const BezierForm &GetBezierForm(void);
+	vec3 Project(vec3 p, float *u);
+	void ProjectBatch(const vec3 *points, int n, float *u, vec3 *out);
+	float ArcLength(float u0, float u1);
+	void ArcSubdivide(float u0, float u1, float len, int depth,
+		std::vector<float> &params, std::vector<float> &lengths);
+	float ParamInTable(const std::vector<float> &params, const std::vector<float> &lengths, int i, float s);
+	void UpdateArcLength(void);
+	float Length(void);
+	float LengthAt(float u);
+	float ParamAtLength(float s);
+	void SampleByLength(int n, float *u);
 };
 Node *CreateTestCurve(void);
+Curve *InterpolateCurve(const vec3 *points, int n, int degree, bool centripetal);
+extern float curveTolerance;
+extern float pixelTolerance;
+extern float arcTolerance;
+extern bool evenCurveSamples;
+
+// tessellation of a Surface at one detail level
+struct SurfaceLevel
+{
+	BasisTable tableU, tableV;
+	std::vector<int> isoGridU, isoGridV;
+	Mesh *surfaceMesh;
+	Mesh *curveMesh;
+	bool staleVertices;
+	int version;	// of the surface it was made from, -1 if none
+
+	SurfaceLevel(void) : surfaceMesh(nil), curveMesh(nil), staleVertices(false), version(-1) {}
+};
+
+// evaluates a Surface's grid from a copy of its CVs
+struct SurfaceJob : public Job
+{
+	std::vector<vec4> CVs;
+	int numU;
+	BasisTable tableU, tableV;
+	std::vector<PackedVertex> verts;
+	std::vector<float> scratch;
+
+	virtual void Run(void);
+};
 
 struct Surface : public Drawable
 {
@@ -399,26 +714,72 @@ struct Surface : public Drawable
 	VertexMesh *cvMesh;
 	std::vector<u8> activeSpansU, activeSpansV;
 	int matID;
+	BasisTable tableU, tableV;	// tessellation grid
+	std::vector<float> samplesU, samplesV;	// next tessellation grid
+	std::vector<float> spanCurvU, spanCurvV;	// curvature bound per knot span
+	BasisTable isoTableU, isoTableV;	// isoparms at the knots
+	std::vector<int> isoGridU, isoGridV;	// tessellation grid sample of each isoparm, or -1
+	std::vector<float> evalScratch;
+	int editU0, editV0, editU1, editV1;	// CVs moved since last update
+	u32 cvBuffer, paramBuffer;	// for computeTessellation
+	bool staleVertices;	// surfaceMesh->vertices behind the vertex buffer
+	BezierForm bezier;	// cached by GetBezierForm
+	int lodLevel;	// -1 before the first tessellation
+	int viewLevel;	// level for the view, lodLevel is coarser during drags
+	int drawLevel;	// cached level drawn until tessJob made lodLevel's mesh, or -1
+	int previewLevels;	// levels left to refine after a drag
+	int previewFrame;	// frameNumber of the last refinement
+	int version;	// counts changes of the surface, for lodCache
+	SurfaceLevel lodCache[MAX_LOD_LEVELS];
+	SurfaceJob *tessJob;	// new grid while the old one is drawn
+	int jobDirty;	// changes since tessJob was queued
 
 	Surface(void);
 	virtual ~Surface(void);
 	virtual void DrawWire(bool active);
 	virtual void DrawShaded(void);
 	virtual void DrawHull(bool active);
-	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist) { return surfaceMesh->IntersectRay(matrix, orig, dir, dist); }
-	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes) { return surfaceMesh->IntersectFrustum(matrix, planes); }
+	virtual void CVMoved(ControlVertex *cv);
+	virtual bool IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist);
+	bool IntersectRayUV(const mat4 &matrix, vec3 orig, vec3 dir, float &dist, float &u, float &v);
+	virtual bool IntersectFrustum(const mat4 &matrix, const vec4 *planes);
 	virtual void FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pickable*> &cvs);
 	void UpdateHull(void);
 	void UpdateCVs(void);
 	void UpdateCurve(void);
+	void IsoparmSamples(LineVertex *verts, const PackedVertex *grid, int u0, int u1, int iv0, int iv1,
+		int iu0, int iu1, int v0, int v1);
 	void UpdateSurface(void);
+	void StartJob(void);
+	bool FinishJob(void);
+	void UpdateBuffers(void);
+	void FreeBuffers(void);
+	void ComputeSurface(int u0, int u1, int v0, int v1);
+	void SyncVertices(void);
+	bool EditedSamples(const BasisTable &tu, const BasisTable &tv, int *u0, int *u1, int *v0, int *v1);
+	virtual void UpdateBound(void);
+	void SwitchLevel(int level);
+	void TrimCache(void);
+	void UpdateTessellation(void);
 	void Update(void);
 
 	vec3 Eval(float u, float v);
+	void EvalDerivs(float u, float v, vec3 *pos, vec3 *du, vec3 *dv);
+	vec3 EvalNormal(float u, float v);
 	int FindParamU(float u);
 	int FindParamV(float v);
+	const BezierForm &GetBezierForm(void);
+	vec3 Project(vec3 p, float *u, float *v);
+	void ProjectBatch(const vec3 *points, int n, float *u, float *v, vec3 *out);
 };
 Node *CreateTestSurface(void);
+Node *CreateTestLoft(void);
+Surface *LoftSurface(Curve **curves, int n, int degreeV, bool centripetal);
+extern float surfaceTolerance;
+extern int dragPreviewLevels;
+extern bool asyncTessellation;
+extern int asyncTessSamples;
+extern bool computeTessellation;
 
 
 #define UNIFORMS \
@@ -437,7 +798,12 @@ Node *CreateTestSurface(void);
 	X(u_ambient) \
 	X(u_lightDiffuse) \
 	X(u_lightSpecular) \
-	X(u_lightDirection)
+	X(u_lightDirection) \
+	X(u_tessPixels) \
+	X(u_degree) \
+	X(u_numCVs) \
+	X(u_numSamples) \
+	X(u_sampleRange)
 
 struct Program
 {
@@ -448,7 +814,7 @@ UNIFORMS
 	void Use(void);
 };
 extern Program *curProg;
-extern Program defProg, cvProg;
+extern Program defProg, cvProg, tessProg, nurbsProg;
 
 extern mat4 proj;
 extern mat4 view;
@@ -457,7 +823,10 @@ extern mat4 unpv;
 extern mat4 worldMat;
 extern mat4 normalMat;
 extern vec3 eyePos;
+extern vec4 viewPlanes[6];
 
 void SetCamera(void);
 void SetWorldMatrix(const mat4 &world);
 void SetMaterial(const Material &mat);
+extern Lighting curLighting;
+void SetLighting(const Lighting &lighting);
@@ -0,0 +1,64 @@
+#include "ithil.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// One worker thread runs the jobs in order.
+// The queue is never destroyed, the thread may still wait on it at exit.
+static std::mutex *queueLock;
+static std::condition_variable *queueCond;
+static std::deque<Job*> *queue;
+
+static void
+Finish(Job *job)
+{
+	int queued = JOB_QUEUED;
+	// nobody waits for it anymore
+	if(!job->state.compare_exchange_strong(queued, JOB_DONE))
+		delete job;
+}
+
+static void
+Worker(void)
+{
+	for(;;) {
+		Job *job;
+		{
+			std::unique_lock<std::mutex> lock(*queueLock);
+			queueCond->wait(lock, []{ return !queue->empty(); });
+			job = queue->front();
+			queue->pop_front();
+		}
+		if(!job->Abandoned())
+			job->Run();
+		Finish(job);
+	}
+}
+
+void
+QueueJob(Job *job)
+{
+	if(queue == nil) {
+		queueLock = new std::mutex;
+		queueCond = new std::condition_variable;
+		queue = new std::deque<Job*>;
+		std::thread(Worker).detach();
+	}
+	job->state = JOB_QUEUED;
+	{
+		std::lock_guard<std::mutex> lock(*queueLock);
+		queue->push_back(job);
+	}
+	queueCond->notify_one();
+}
+
+// The job is deleted once it is done, Run should return early
+void
+AbandonJob(Job *job)
+{
+	int queued = JOB_QUEUED;
+	if(!job->state.compare_exchange_strong(queued, JOB_ABANDONED))
+		delete job;
+}
@@ -1,10 +1,16 @@
 #include "ithil.h"
 #include "glad/glad.h"
 
-#include <glm/gtx/intersect.hpp>
-
 #include <stdio.h>
 #include <float.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 void
 Box::Init(void)
@@ -41,17 +47,212 @@ IsPointInFrustum(vec3 point, const vec4 *planes)
 	return true;
 }
 
+// false only if the sphere is completely outside of a plane
+bool
+IsSphereInFrustum(const Sphere &sphere, const vec4 *planes)
+{
+	vec4 c(sphere.center, 1.0f);
+	for(int i = 0; i < 6; i++)
+		if(dot(planes[i], c) < -sphere.radius*length(vec3(planes[i])))
+			return false;
+	return true;
+}
+
+// Outside if the box is completely outside of a plane,
+// inside if completely inside of all of them
+int
+BoxInFrustum(const Box &box, const vec4 *planes)
+{
+	int ret = FRUSTUM_INSIDE;
+	for(int i = 0; i < 6; i++) {
+		vec3 n(planes[i]);
+		// corners furthest along and against the normal
+		vec3 pos(n.x > 0.0f ? box.sup.x : box.inf.x,
+			n.y > 0.0f ? box.sup.y : box.inf.y,
+			n.z > 0.0f ? box.sup.z : box.inf.z);
+		vec3 neg(n.x > 0.0f ? box.inf.x : box.sup.x,
+			n.y > 0.0f ? box.inf.y : box.sup.y,
+			n.z > 0.0f ? box.inf.z : box.sup.z);
+		if(dot(planes[i], vec4(pos, 1.0f)) < 0.0f)
+			return FRUSTUM_OUTSIDE;
+		if(dot(planes[i], vec4(neg, 1.0f)) < 0.0f)
+			ret = FRUSTUM_INTERSECT;
+	}
+	return ret;
+}
+
+// false if the line through orig along dir misses the sphere
+bool
+IsSphereOnRay(const Sphere &sphere, vec3 orig, vec3 dir)
+{
+	vec3 d = sphere.center - orig;
+	float l = dot(dir, dir);
+	if(l == 0.0f)
+		return true;
+	vec3 perp = d - dot(d, dir)/l*dir;
+	return dot(perp, perp) <= sphere.radius*sphere.radius;
+}
 
+// Slab test of the ray against a box for t in [0,tmax]
+bool
+RayHitsBox(const Box &box, vec3 orig, vec3 invDir, float tmax, float *tnear)
+{
+	float t0 = 0.0f;
+	float t1 = tmax;
+	for(int i = 0; i < 3; i++) {
+		float a = (box.inf[i] - orig[i])*invDir[i];
+		float b = (box.sup[i] - orig[i])*invDir[i];
+		if(a > b)
+			std::swap(a, b);
+		// NaN from 0*inf means the ray lies in the slab's boundary
+		if(a == a)
+			t0 = max(t0, a);
+		if(b == b)
+			t1 = min(t1, b);
+		if(t0 > t1)
+			return false;
+	}
+	if(tnear)
+		*tnear = t0;
+	return true;
+}
+
+// Planes of the frustum of a projection matrix, facing inwards
+// like those built for picking
+void
+FrustumPlanes(const mat4 &m, vec4 *planes)
+{
+	mat4 t = glm::transpose(m);
+	planes[0] = t[3] + t[2];	// near
+	planes[1] = t[3] - t[2];	// far
+	planes[2] = t[3] - t[0];	// right
+	planes[3] = t[3] - t[1];	// top
+	planes[4] = t[3] + t[0];	// left
+	planes[5] = t[3] + t[1];	// bottom
+}
+
+bool
+Drawable::BoundInFrustum(const mat4 &matrix, const vec4 *planes)
+{
+	UpdateBound();
+	vec4 localPlanes[6];
+	mat4 mt = glm::transpose(matrix);
+	for(int i = 0; i < 6; i++)
+		localPlanes[i] = mt * planes[i];
+	return IsSphereInFrustum(boundSphere, localPlanes);
+}
+
+bool
+Drawable::BoundOnRay(const mat4 &matrix, vec3 orig, vec3 dir)
+{
+	UpdateBound();
+	mat4 inv = glm::inverse(matrix);
+	return IsSphereOnRay(boundSphere, vec3(inv * vec4(orig, 1.0f)), glm::mat3(inv) * dir);
+}
+
+
+
+const VertexLayout vertexLayout = { sizeof(Vertex), 3, {
+	{ 0, 3, GL_FLOAT, false, offsetof(Vertex, pos) },
+	{ 1, 4, GL_UNSIGNED_BYTE, true, offsetof(Vertex, color) },
+	{ 2, 3, GL_FLOAT, false, offsetof(Vertex, normal) },
+} };
+// cv.vert takes the icon's uv in place of the normal
+const VertexLayout iconVertexLayout = { sizeof(Vertex), 3, {
+	{ 0, 3, GL_FLOAT, false, offsetof(Vertex, pos) },
+	{ 1, 4, GL_UNSIGNED_BYTE, true, offsetof(Vertex, color) },
+	{ 2, 2, GL_FLOAT, false, offsetof(Vertex, uv) },
+} };
+const VertexLayout lineVertexLayout = { sizeof(LineVertex), 2, {
+	{ 0, 3, GL_FLOAT, false, offsetof(LineVertex, pos) },
+	{ 1, 4, GL_UNSIGNED_BYTE, true, offsetof(LineVertex, color) },
+} };
+const VertexLayout packedVertexLayout = { sizeof(PackedVertex), 4, {
+	{ 0, 3, GL_FLOAT, false, offsetof(PackedVertex, pos) },
+	{ 1, 4, GL_UNSIGNED_BYTE, true, offsetof(PackedVertex, color) },
+	{ 2, 4, GL_INT_2_10_10_10_REV, true, offsetof(PackedVertex, normal) },
+	{ 3, 2, GL_HALF_FLOAT, false, offsetof(PackedVertex, uv) },
+} };
+
+// unit normal to GL_INT_2_10_10_10_REV, w is 0
+u32
+PackNormal(vec3 n)
+{
+	u32 x = (u32)(i32)roundf(clamp(n.x, -1.0f, 1.0f)*511.0f) & 0x3FF;
+	u32 y = (u32)(i32)roundf(clamp(n.y, -1.0f, 1.0f)*511.0f) & 0x3FF;
+	u32 z = (u32)(i32)roundf(clamp(n.z, -1.0f, 1.0f)*511.0f) & 0x3FF;
+	return x | y<<10 | z<<20;
+}
+
+// round to nearest, no denormals
+u16
+PackHalf(float f)
+{
+	u32 x;
+	memcpy(&x, &f, 4);
+	u32 sign = x>>16 & 0x8000;
+	i32 e = (i32)(x>>23 & 0xFF) - 127 + 15;
+	u32 m = x & 0x7FFFFF;
+	if(e <= 0)
+		return sign;
+	if(e >= 31)
+		return sign | 0x7C00;
+	u32 h = sign | e<<10 | m>>13;
+	// carry into the exponent is fine
+	if(m & 0x1000)
+		h++;
+	return h;
+}
+
+// attributes of a vertex buffer bound to binding point 0
+static void
+SetupLayout(u32 vao, const VertexLayout *layout)
+{
+	for(int i = 0; i < layout->numAttribs; i++) {
+		const VertexAttrib &a = layout->attribs[i];
+		glEnableVertexArrayAttrib(vao, a.location);
+		glVertexArrayAttribFormat(vao, a.location, a.size, a.type, a.normalized, a.offset);
+		glVertexArrayAttribBinding(vao, a.location, 0);
+	}
+}
 
 Mesh::~Mesh(void)
 {
-	delete[] indices;
-	delete[] (Vertex*)vertices;
+	if(wideIndices)
+		delete[] indices32;
+	else
+		delete[] indices;
+	delete[] (u8*)vertices;
 	glDeleteBuffers(1, &vbo);
 	glDeleteBuffers(1, &ibo);
 	glDeleteVertexArrays(1, &vao);
 }
 
+u32
+Mesh::IndexType(void)
+{
+	return wideIndices ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+}
+
+// base vertex of the submesh index i is in
+u32
+Mesh::ChunkBase(u32 i)
+{
+	auto it = std::upper_bound(submeshes.begin(), submeshes.end(), i,
+		[](u32 i, const Submesh &m) { return i < m.firstIndex; });
+	return it[-1].baseVertex;
+}
+
+void
+Mesh::DrawElements(u32 count, u32 first, u32 baseVertex)
+{
+	void *offset = (void*)(uintptr_t)(first*IndexSize());
+	if(baseVertex)
+		glDrawElementsBaseVertex(primType, count, IndexType(), offset, baseVertex);
+	else
+		glDrawElements(primType, count, IndexType(), offset);
+}
+
 void
 Mesh::DrawShaded(void)
 {
@@ -64,23 +265,327 @@ Mesh::DrawShaded(void)
 			SetMaterial(defMat);	// TODO: maybe some error material
 		else
 			SetMaterial(materials[m.matID]);
-		glDrawElements(primType, m.numIndices, GL_UNSIGNED_SHORT, (void*)(uintptr_t)offset);
-		offset += m.numIndices*sizeof(u16);
+		DrawElements(m.numIndices, offset, m.baseVertex);
+		offset += m.numIndices;
 	}
 }
 void
 Mesh::DrawWire(bool active)
 {
 	ForceColor(active ? activeColor : hullColor);
-	glBindVertexArray(vao);
-	glDrawElements(primType, numIndices, GL_UNSIGNED_SHORT, 0);
+	DrawRaw();
 }
 
 void
 Mesh::DrawRaw(void)
 {
 	glBindVertexArray(vao);
-	glDrawElements(primType, numIndices, GL_UNSIGNED_SHORT, 0);
+	if(chunked) {
+		for(const auto &m : submeshes)
+			DrawElements(m.numIndices, m.firstIndex, m.baseVertex);
+	} else
+		DrawElements(numIndices, 0, 0);
+}
+
+// Binned SAH build of the triangles bvhTris[first, first+count).
+// Nodes are stored depth first, the first child follows its parent.
+#define BVH_BINS 16
+#define BVH_LEAF TRI_BLOCK
+
+static float
+BoxArea(const Box &b)
+{
+	vec3 d = b.sup - b.inf;
+	return d.x*d.y + d.y*d.z + d.z*d.x;
+}
+
+static void
+ContainBox(Box &b, const Box &c)
+{
+	for(int i = 0; i < 3; i++) {
+		if(c.inf[i] < b.inf[i]) b.inf[i] = c.inf[i];
+		if(c.sup[i] > b.sup[i]) b.sup[i] = c.sup[i];
+	}
+}
+
+void
+Mesh::BuildBVHNode(u32 first, u32 count, const Box *triBoxes, int depth)
+{
+	u32 n = bvh.size();
+	bvh.push_back(BVHNode());
+	Box box, cbox;
+	box.Init();
+	cbox.Init();
+	for(u32 i = first; i < first+count; i++) {
+		const Box &tb = triBoxes[bvhTris[i]];
+		ContainBox(box, tb);
+		cbox.ContainPoint((tb.inf + tb.sup)*0.5f);
+	}
+	bvh[n].box = box;
+	bvh[n].first = first;
+	bvh[n].count = count;
+	// the traversal stack has room for 64 levels
+	if(count <= BVH_LEAF || depth >= 60)
+		return;
+
+	vec3 ext = cbox.sup - cbox.inf;
+	int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+	if(ext[axis] <= 0.0f)
+		return;	// all centroids in one spot
+	float scale = BVH_BINS/ext[axis];
+	float lo = cbox.inf[axis];
+	auto Bin = [&](u32 t) {
+		const Box &tb = triBoxes[t];
+		int b = ((tb.inf[axis] + tb.sup[axis])*0.5f - lo)*scale;
+		return min(b, BVH_BINS-1);
+	};
+
+	Box bins[BVH_BINS];
+	u32 binCounts[BVH_BINS] = { 0 };
+	for(int b = 0; b < BVH_BINS; b++)
+		bins[b].Init();
+	for(u32 i = first; i < first+count; i++) {
+		int b = Bin(bvhTris[i]);
+		ContainBox(bins[b], triBoxes[bvhTris[i]]);
+		binCounts[b]++;
+	}
+
+	// cost of splitting after bin b, sweeping from both ends
+	float rightCost[BVH_BINS];
+	Box acc;
+	acc.Init();
+	u32 num = 0;
+	for(int b = BVH_BINS-1; b > 0; b--) {
+		ContainBox(acc, bins[b]);
+		num += binCounts[b];
+		rightCost[b-1] = num ? num*BoxArea(acc) : 0.0f;
+	}
+	float bestCost = FLT_MAX;
+	int split = -1;
+	acc.Init();
+	num = 0;
+	for(int b = 0; b < BVH_BINS-1; b++) {
+		ContainBox(acc, bins[b]);
+		num += binCounts[b];
+		if(num == 0 || num == count)
+			continue;
+		float cost = num*BoxArea(acc) + rightCost[b];
+		if(cost < bestCost) {
+			bestCost = cost;
+			split = b;
+		}
+	}
+
+	u32 *tris = &bvhTris[0];
+	u32 mid;
+	if(split >= 0 && bestCost < count*BoxArea(box))
+		mid = std::partition(tris+first, tris+first+count,
+			[&](u32 t) { return Bin(t) <= split; }) - tris;
+	else if(count > 4*BVH_LEAF) {
+		// too big for a leaf anyway, split at the median
+		mid = first + count/2;
+		std::nth_element(tris+first, tris+mid, tris+first+count,
+			[&](u32 a, u32 b) {
+				return triBoxes[a].inf[axis] + triBoxes[a].sup[axis] <
+					triBoxes[b].inf[axis] + triBoxes[b].sup[axis];
+			});
+	} else
+		return;
+
+	bvh[n].count = 0;
+	BuildBVHNode(first, mid-first, triBoxes, depth+1);
+	bvh[n].first = bvh.size();
+	BuildBVHNode(mid, first+count-mid, triBoxes, depth+1);
+}
+
+void
+Mesh::TriangleBox(u32 t, Box &box)
+{
+	box.Init();
+	box.ContainPoint(GetVertex(GetIndex(t*3+0)));
+	box.ContainPoint(GetVertex(GetIndex(t*3+1)));
+	box.ContainPoint(GetVertex(GetIndex(t*3+2)));
+}
+
+void
+Mesh::BuildBVH(void)
+{
+	u32 numTris = numIndices/3;
+	std::vector<Box> triBoxes(numTris);
+	bvhTris.resize(numTris);
+	for(u32 i = 0; i < numTris; i++) {
+		TriangleBox(i, triBoxes[i]);
+		bvhTris[i] = i;
+	}
+	bvh.clear();
+	if(numTris > 0)
+		BuildBVHNode(0, numTris, &triBoxes[0], 0);
+
+	// leaves start on a block, the last triangle fills up the rest
+	std::vector<u32> tris;
+	for(BVHNode &node : bvh) {
+		if(node.count == 0)
+			continue;
+		u32 first = tris.size();
+		for(u32 i = 0; i < node.count; i++)
+			tris.push_back(bvhTris[node.first+i]);
+		while(tris.size() % TRI_BLOCK)
+			tris.push_back(tris.back());
+		node.first = first;
+	}
+	bvhTris.swap(tris);
+	bvhBlocks.resize(bvhTris.size()/TRI_BLOCK);
+	for(u32 i = 0; i < bvhBlocks.size(); i++)
+		FillBlock(i);
+	bvhStale = false;
+}
+
+void
+Mesh::FillBlock(u32 b)
+{
+	TriBlock &blk = bvhBlocks[b];
+	for(int l = 0; l < TRI_BLOCK; l++) {
+		u32 t = bvhTris[b*TRI_BLOCK + l];
+		vec3 v0 = GetVertex(GetIndex(t*3+0));
+		vec3 e1 = GetVertex(GetIndex(t*3+1)) - v0;
+		vec3 e2 = GetVertex(GetIndex(t*3+2)) - v0;
+		for(int i = 0; i < 3; i++) {
+			blk.v0[i][l] = v0[i];
+			blk.e1[i][l] = e1[i];
+			blk.e2[i][l] = e2[i];
+		}
+	}
+}
+
+// Moeller-Trumbore against all triangles of a block at once.
+// Closest hit with 0 <= t < tmax, or -1.
+// Rays about parallel to a triangle miss it, like in glm.
+#ifdef __AVX__
+typedef __m256 tvec;
+static inline tvec tset(float f) { return _mm256_set1_ps(f); }
+static inline tvec tload(const float *p) { return _mm256_loadu_ps(p); }
+static inline void tstore(float *p, tvec a) { _mm256_storeu_ps(p, a); }
+static inline tvec tadd(tvec a, tvec b) { return _mm256_add_ps(a, b); }
+static inline tvec tsub(tvec a, tvec b) { return _mm256_sub_ps(a, b); }
+static inline tvec tmul(tvec a, tvec b) { return _mm256_mul_ps(a, b); }
+static inline tvec tdiv(tvec a, tvec b) { return _mm256_div_ps(a, b); }
+static inline tvec tand(tvec a, tvec b) { return _mm256_and_ps(a, b); }
+static inline tvec tabs(tvec a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline tvec tge(tvec a, tvec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline tvec tlt(tvec a, tvec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline int tmask(tvec a) { return _mm256_movemask_ps(a); }
+#elif defined(__SSE__)
+typedef __m128 tvec;
+static inline tvec tset(float f) { return _mm_set1_ps(f); }
+static inline tvec tload(const float *p) { return _mm_loadu_ps(p); }
+static inline void tstore(float *p, tvec a) { _mm_storeu_ps(p, a); }
+static inline tvec tadd(tvec a, tvec b) { return _mm_add_ps(a, b); }
+static inline tvec tsub(tvec a, tvec b) { return _mm_sub_ps(a, b); }
+static inline tvec tmul(tvec a, tvec b) { return _mm_mul_ps(a, b); }
+static inline tvec tdiv(tvec a, tvec b) { return _mm_div_ps(a, b); }
+static inline tvec tand(tvec a, tvec b) { return _mm_and_ps(a, b); }
+static inline tvec tabs(tvec a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline tvec tge(tvec a, tvec b) { return _mm_cmpge_ps(a, b); }
+static inline tvec tlt(tvec a, tvec b) { return _mm_cmplt_ps(a, b); }
+static inline int tmask(tvec a) { return _mm_movemask_ps(a); }
+#endif
+
+static int
+IntersectBlock(const TriBlock &b, vec3 orig, vec3 dir, float tmax, float &t)
+{
+#if defined(__AVX__) || defined(__SSE__)
+	tvec dx = tset(dir.x), dy = tset(dir.y), dz = tset(dir.z);
+	tvec e1x = tload(b.e1[0]), e1y = tload(b.e1[1]), e1z = tload(b.e1[2]);
+	tvec e2x = tload(b.e2[0]), e2y = tload(b.e2[1]), e2z = tload(b.e2[2]);
+	// p = dir x e2
+	tvec px = tsub(tmul(dy, e2z), tmul(dz, e2y));
+	tvec py = tsub(tmul(dz, e2x), tmul(dx, e2z));
+	tvec pz = tsub(tmul(dx, e2y), tmul(dy, e2x));
+	tvec det = tadd(tadd(tmul(e1x, px), tmul(e1y, py)), tmul(e1z, pz));
+	tvec inv = tdiv(tset(1.0f), det);
+	// s = orig - v0, q = s x e1
+	tvec sx = tsub(tset(orig.x), tload(b.v0[0]));
+	tvec sy = tsub(tset(orig.y), tload(b.v0[1]));
+	tvec sz = tsub(tset(orig.z), tload(b.v0[2]));
+	tvec u = tmul(tadd(tadd(tmul(sx, px), tmul(sy, py)), tmul(sz, pz)), inv);
+	tvec qx = tsub(tmul(sy, e1z), tmul(sz, e1y));
+	tvec qy = tsub(tmul(sz, e1x), tmul(sx, e1z));
+	tvec qz = tsub(tmul(sx, e1y), tmul(sy, e1x));
+	tvec v = tmul(tadd(tadd(tmul(dx, qx), tmul(dy, qy)), tmul(dz, qz)), inv);
+	tvec d = tmul(tadd(tadd(tmul(e2x, qx), tmul(e2y, qy)), tmul(e2z, qz)), inv);
+	// comparisons with NaN from degenerate triangles are false
+	tvec zero = tset(0.0f);
+	tvec ok = tlt(tset(FLT_EPSILON), tabs(det));
+	ok = tand(ok, tand(tge(u, zero), tge(v, zero)));
+	ok = tand(ok, tge(tset(1.0f), tadd(u, v)));
+	ok = tand(ok, tand(tge(d, zero), tlt(d, tset(tmax))));
+	int mask = tmask(ok);
+	if(mask == 0)
+		return -1;
+	float ds[TRI_BLOCK];
+	tstore(ds, d);
+#else
+	int mask = 0;
+	float ds[TRI_BLOCK];
+	for(int l = 0; l < TRI_BLOCK; l++) {
+		vec3 e1(b.e1[0][l], b.e1[1][l], b.e1[2][l]);
+		vec3 e2(b.e2[0][l], b.e2[1][l], b.e2[2][l]);
+		vec3 p = cross(dir, e2);
+		float det = dot(e1, p);
+		if(fabsf(det) <= FLT_EPSILON)
+			continue;
+		float inv = 1.0f/det;
+		vec3 s = orig - vec3(b.v0[0][l], b.v0[1][l], b.v0[2][l]);
+		vec3 q = cross(s, e1);
+		float u = dot(s, p)*inv;
+		float v = dot(dir, q)*inv;
+		ds[l] = dot(e2, q)*inv;
+		if(u >= 0.0f && v >= 0.0f && u+v <= 1.0f && ds[l] >= 0.0f && ds[l] < tmax)
+			mask |= 1<<l;
+	}
+	if(mask == 0)
+		return -1;
+#endif
+	int hit = -1;
+	for(int l = 0; l < TRI_BLOCK; l++)
+		if(mask & 1<<l && (hit < 0 || ds[l] < ds[hit]))
+			hit = l;
+	t = ds[hit];
+	return hit;
+}
+
+// Vertices moved but the triangles are the same,
+// children come after their parents so go backwards
+void
+Mesh::RefitBVH(void)
+{
+	for(u32 n = bvh.size(); n-- > 0;) {
+		BVHNode &node = bvh[n];
+		if(node.count > 0) {
+			node.box.Init();
+			for(u32 i = node.first; i < node.first+node.count; i++) {
+				Box tb;
+				TriangleBox(bvhTris[i], tb);
+				ContainBox(node.box, tb);
+			}
+			for(u32 b = node.first/TRI_BLOCK; b*TRI_BLOCK < node.first+node.count; b++)
+				FillBlock(b);
+		} else {
+			node.box = bvh[n+1].box;
+			ContainBox(node.box, bvh[node.first].box);
+		}
+	}
+	bvhStale = false;
+}
+
+// built on the first pick, refit when the vertices changed
+void
+Mesh::UpdateBVH(void)
+{
+	if(bvh.empty())
+		BuildBVH();
+	else if(bvhStale)
+		RefitBVH();
 }
 
 bool
@@ -94,21 +599,41 @@ if(primType != GL_TRIANGLES) return false;
 	vec3 localOrig = vec3(inv * vec4(orig, 1.0f));
 	vec3 localDir = mat3(inv) * dir;
 
-	vec3 dummy;
-	if(!intersectRaySphere(localOrig, normalize(localDir), boundSphere.center, boundSphere.radius, dummy, dummy))
+	UpdateBVH();
+	if(bvh.empty())
 		return false;
 
 	float closestDist = 1.0f;
 	bool wasHit = false;
-	for(u32 i = 0; i < numIndices; i += 3) {
-		vec3 v0 = GetVertex(indices[i+0]);
-		vec3 v1 = GetVertex(indices[i+1]);
-		vec3 v2 = GetVertex(indices[i+2]);
-		vec2 bary;
-		float d;
-
-		if(intersectRayTriangle(localOrig, localDir, v0, v1, v2, bary, d)) {
-			if(d < closestDist) {
+	vec3 invDir = vec3(1.0f)/localDir;
+	u32 stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while(sp > 0) {
+		const BVHNode &node = bvh[stack[--sp]];
+		if(!RayHitsBox(node.box, localOrig, invDir, closestDist))
+			continue;
+		if(node.count == 0) {
+			// visit the nearer child first so the far one can be culled
+			u32 c0 = &node - &bvh[0] + 1;
+			u32 c1 = node.first;
+			float t0, t1;
+			bool hit0 = RayHitsBox(bvh[c0].box, localOrig, invDir, closestDist, &t0);
+			bool hit1 = RayHitsBox(bvh[c1].box, localOrig, invDir, closestDist, &t1);
+			if(hit0 && hit1) {
+				if(t1 < t0)
+					std::swap(c0, c1);
+				stack[sp++] = c1;
+				stack[sp++] = c0;
+			} else if(hit0)
+				stack[sp++] = c0;
+			else if(hit1)
+				stack[sp++] = c1;
+			continue;
+		}
+		for(u32 b = node.first/TRI_BLOCK; b*TRI_BLOCK < node.first+node.count; b++) {
+			float d;
+			if(IntersectBlock(bvhBlocks[b], localOrig, localDir, closestDist, d) >= 0) {
 				closestDist = d;
 				wasHit = true;
 			}
@@ -143,6 +668,35 @@ ClipTriangle(vec3 *in, int nin, vec3 *out, vec4 plane)
 	return nout;
 }
 
+// Clip the triangle against the frustum and see if anything stays inside
+static bool
+TriangleInFrustum(vec3 v0, vec3 v1, vec3 v2, const vec4 *planes)
+{
+	if(IsPointInFrustum(v0, planes) ||
+	   IsPointInFrustum(v1, planes) ||
+	   IsPointInFrustum(v2, planes))
+		return true;
+
+	vec3 buf[18];
+	vec3 *in, *out;
+	int nout;
+	in = &buf[0];
+	out = &buf[9];
+	in[0] = v0;
+	in[1] = v1;
+	in[2] = v2;
+	nout = 0;
+
+	if(nout = ClipTriangle(in,  3,    out, planes[0]), nout == 0) return false;
+	if(nout = ClipTriangle(out, nout, in,  planes[1]), nout == 0) return false;
+	if(nout = ClipTriangle(in,  nout, out, planes[2]), nout == 0) return false;
+	if(nout = ClipTriangle(out, nout, in,  planes[3]), nout == 0) return false;
+	if(nout = ClipTriangle(in,  nout, out, planes[4]), nout == 0) return false;
+	if(nout = ClipTriangle(out, nout, in,  planes[5]), nout == 0) return false;
+
+	return true;
+}
+
 bool
 Mesh::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
 {
@@ -151,43 +705,48 @@ Mesh::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
 	for(int i = 0; i < 6; i++)
 		localPlanes[i] = mt * planes[i];
 
-	// easy test - check if any vertex is inside the frustum
-	for(u32 i = 0; i < numIndices; i++)
-		if(IsPointInFrustum(GetVertex(indices[i]), localPlanes))
-			return true;
-
-// TODO:
-if(primType != GL_TRIANGLES) return false;
-	// harder test, clip triangles against frustum and see if anything stays inside
-	vec3 buf[18];
-	vec3 *in, *out;
-	int nout;
-	for(u32 i = 0; i < numIndices; i += 3) {
-		vec3 v0 = GetVertex(indices[i+0]);
-		vec3 v1 = GetVertex(indices[i+1]);
-		vec3 v2 = GetVertex(indices[i+2]);
-		in = &buf[0];
-		out = &buf[9];
-		in[0] = v0;
-		in[1] = v1;
-		in[2] = v2;
-		nout = 0;
-
-		if(nout = ClipTriangle(in,  3,    out, localPlanes[0]), nout == 0) continue;
-		if(nout = ClipTriangle(out, nout, in,  localPlanes[1]), nout == 0) continue;
-		if(nout = ClipTriangle(in,  nout, out, localPlanes[2]), nout == 0) continue;
-		if(nout = ClipTriangle(out, nout, in,  localPlanes[3]), nout == 0) continue;
-		if(nout = ClipTriangle(in,  nout, out, localPlanes[4]), nout == 0) continue;
-		if(nout = ClipTriangle(out, nout, in,  localPlanes[5]), nout == 0) continue;
+	if(primType != GL_TRIANGLES) {
+		// only check if any vertex is inside the frustum
+		for(u32 i = 0; i < numIndices; i++)
+			if(IsPointInFrustum(GetVertex(GetIndex(i)), localPlanes))
+				return true;
+		return false;
+	}
 
-		return true;
+	// whole subtrees are in or out, only triangles
+	// in leaves crossing the frustum are clipped
+	UpdateBVH();
+	if(bvh.empty())
+		return false;
+	u32 stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while(sp > 0) {
+		u32 n = stack[--sp];
+		const BVHNode &node = bvh[n];
+		int in = BoxInFrustum(node.box, localPlanes);
+		if(in == FRUSTUM_OUTSIDE)
+			continue;
+		if(in == FRUSTUM_INSIDE)
+			return true;
+		if(node.count == 0) {
+			stack[sp++] = node.first;
+			stack[sp++] = n+1;
+			continue;
+		}
+		for(u32 i = node.first; i < node.first+node.count; i++) {
+			u32 t = bvhTris[i];
+			if(TriangleInFrustum(GetVertex(GetIndex(t*3+0)),
+			   GetVertex(GetIndex(t*3+1)),
+			   GetVertex(GetIndex(t*3+2)), localPlanes))
+				return true;
+		}
 	}
 	return false;
 }
 
-
-Mesh*
-CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, u32 stride)
+static Mesh*
+MakeMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, void *indices, bool wide, const VertexLayout *layout)
 {
 	Mesh *mesh = new Mesh;
 
@@ -195,8 +754,15 @@ CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *i
 	mesh->numVertices = numVertices;
 	mesh->vertices = vertices;
 	mesh->numIndices = numIndices;
-	mesh->indices = indices;
-	mesh->stride = stride;
+	if(wide)
+		mesh->indices32 = (u32*)indices;
+	else
+		mesh->indices = (u16*)indices;
+	mesh->wideIndices = wide;
+	mesh->layout = layout;
+	mesh->stride = layout->stride;
+	mesh->maxVertices = numVertices;
+	mesh->maxIndices = numIndices;
 
 	mesh->boundBox.Init();
 	for(u32 i = 0; i < numVertices; i++)
@@ -204,23 +770,15 @@ CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *i
 	mesh->boundSphere.FromBox(mesh->boundBox);
 
 	glCreateBuffers(1, &mesh->vbo);
-	glNamedBufferStorage(mesh->vbo, numVertices*stride, vertices, GL_DYNAMIC_STORAGE_BIT);
+	glNamedBufferStorage(mesh->vbo, numVertices*mesh->stride, vertices, GL_DYNAMIC_STORAGE_BIT);
 	glCreateBuffers(1, &mesh->ibo);
-	glNamedBufferStorage(mesh->ibo, numIndices*sizeof(u16), indices, GL_DYNAMIC_STORAGE_BIT);
+	glNamedBufferStorage(mesh->ibo, numIndices*mesh->IndexSize(), indices, GL_DYNAMIC_STORAGE_BIT);
 
 	glCreateVertexArrays(1, &mesh->vao);
-	glVertexArrayVertexBuffer(mesh->vao, 0, mesh->vbo, 0, stride);
+	glVertexArrayVertexBuffer(mesh->vao, 0, mesh->vbo, 0, mesh->stride);
 	glVertexArrayElementBuffer(mesh->vao, mesh->ibo);
 
-	glEnableVertexArrayAttrib(mesh->vao, 0);
-	glEnableVertexArrayAttrib(mesh->vao, 1);
-	glEnableVertexArrayAttrib(mesh->vao, 2);
-	glVertexArrayAttribFormat(mesh->vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, pos));
-	glVertexArrayAttribFormat(mesh->vao, 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(Vertex, color));
-	glVertexArrayAttribFormat(mesh->vao, 2, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
-	glVertexArrayAttribBinding(mesh->vao, 0, 0);
-	glVertexArrayAttribBinding(mesh->vao, 1, 0);
-	glVertexArrayAttribBinding(mesh->vao, 2, 0);
+	SetupLayout(mesh->vao, layout);
 
 	Mesh::Submesh sm;
 	sm.numIndices = numIndices;
@@ -231,22 +789,151 @@ CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *i
 	return mesh;
 }
 
+Mesh*
+CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, const VertexLayout *layout)
+{
+	return MakeMesh(primType, numVertices, vertices, numIndices, indices, false, layout);
+}
+
+// takes over the indices
+static u16*
+NarrowIndices(u32 *indices, u32 numIndices)
+{
+	u16 *narrow = new u16[numIndices];
+	for(u32 i = 0; i < numIndices; i++)
+		narrow[i] = indices[i];
+	delete[] indices;
+	return narrow;
+}
+
+// 16 bit indices if the vertices allow
+Mesh*
+CreateMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u32 *indices, const VertexLayout *layout)
+{
+	if(numVertices <= 0x10000)
+		return MakeMesh(primType, numVertices, vertices, numIndices, NarrowIndices(indices, numIndices), false, layout);
+	return MakeMesh(primType, numVertices, vertices, numIndices, indices, true, layout);
+}
+
+// Split lines or triangles into chunks of at most 0x10000 vertices
+// with 16 bit indices, the chunks are also submeshes with a baseVertex.
+// Vertices are copied, those shared between chunks more than once,
+// vertexMap gets the original vertex of every new one.
+Mesh*
+CreateChunkedMesh(u32 primType, u32 numVertices, const void *vertices, u32 numIndices, const u32 *indices, const VertexLayout *layout,
+	const std::vector<Mesh::Submesh> &submeshes, std::vector<u32> &vertexMap)
+{
+	assert(primType == GL_TRIANGLES || primType == GL_LINES);
+	u32 stride = layout->stride;
+	u32 primSize = primType == GL_TRIANGLES ? 3 : 2;
+	std::vector<u32> chunkOf(numVertices, ~0u);
+	std::vector<u16> local(numVertices);
+	std::vector<Mesh::Submesh> chunks;
+	u16 *out = new u16[numIndices];
+	vertexMap.clear();
+
+	u32 chunk = 0;
+	Mesh::Submesh sm;
+	u32 idx = 0;
+	for(const auto &m : submeshes) {
+		sm.matID = m.matID;
+		sm.firstIndex = idx;
+		sm.numIndices = 0;
+		for(u32 i = 0; i < m.numIndices; i += primSize) {
+			if(vertexMap.size() - sm.baseVertex + primSize > 0x10000) {
+				if(sm.numIndices > 0)
+					chunks.push_back(sm);
+				chunk++;
+				sm.baseVertex = vertexMap.size();
+				sm.firstIndex = idx;
+				sm.numIndices = 0;
+			}
+			for(u32 j = 0; j < primSize; j++) {
+				u32 v = indices[idx];
+				if(chunkOf[v] != chunk) {
+					chunkOf[v] = chunk;
+					local[v] = vertexMap.size() - sm.baseVertex;
+					vertexMap.push_back(v);
+				}
+				out[idx++] = local[v];
+			}
+			sm.numIndices += primSize;
+		}
+		if(sm.numIndices > 0)
+			chunks.push_back(sm);
+	}
+	assert(idx == numIndices);
+
+	u32 n = vertexMap.size();
+	u8 *verts = new u8[n*stride];
+	for(u32 i = 0; i < n; i++)
+		memcpy(verts + i*stride, (const u8*)vertices + vertexMap[i]*stride, stride);
+
+	Mesh *mesh = MakeMesh(primType, n, verts, numIndices, out, false, layout);
+	mesh->submeshes = chunks;
+	mesh->chunked = true;
+	return mesh;
+}
+
 void
 Mesh::UpdateMesh(void)
 {
+	bvhStale = true;
 	glNamedBufferSubData(vbo, 0, numVertices*stride, vertices);
 }
 
+void
+Mesh::UpdateMesh(u32 first, u32 count)
+{
+	bvhStale = true;
+	glNamedBufferSubData(vbo, first*stride, count*stride, (u8*)vertices + first*stride);
+}
+
 void
 Mesh::UpdateIndices(void)
 {
-	glNamedBufferSubData(ibo, 0, numIndices*sizeof(u16), indices);
+	bvh.clear();
+	glNamedBufferSubData(ibo, 0, numIndices*IndexSize(), indices);
 }
 
+// Change vertex and index counts of a non-instanced mesh.
+// Storage only ever grows, contents are undefined afterwards.
+void
+Mesh::Resize(u32 numVertices, u32 numIndices)
+{
+	if(numVertices > maxVertices) {
+		maxVertices = numVertices + numVertices/2;
+		delete[] (u8*)vertices;
+		vertices = new u8[maxVertices*stride];
+		// buffer storage is immutable
+		glDeleteBuffers(1, &vbo);
+		glCreateBuffers(1, &vbo);
+		glNamedBufferStorage(vbo, maxVertices*stride, nil, GL_DYNAMIC_STORAGE_BIT);
+		glVertexArrayVertexBuffer(vao, 0, vbo, 0, stride);
+	}
+	if(numIndices > maxIndices) {
+		maxIndices = numIndices + numIndices/2;
+		if(wideIndices) {
+			delete[] indices32;
+			indices32 = new u32[maxIndices];
+		} else {
+			delete[] indices;
+			indices = new u16[maxIndices];
+		}
+		glDeleteBuffers(1, &ibo);
+		glCreateBuffers(1, &ibo);
+		glNamedBufferStorage(ibo, maxIndices*IndexSize(), nil, GL_DYNAMIC_STORAGE_BIT);
+		glVertexArrayElementBuffer(vao, ibo);
+	}
+	this->numVertices = numVertices;
+	this->numIndices = numIndices;
+	bvh.clear();
+}
 
 
-VertexMesh*
-CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, u32 stride, InstData *instData, u32 nInst)
+
+static VertexMesh*
+MakeInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, void *indices, bool wide, const VertexLayout *layout, InstData *instData, u32 nInst)
 {
 	VertexMesh *mesh = new VertexMesh;
 
@@ -254,8 +941,16 @@ CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices
 	mesh->numVertices = numVertices;
 	mesh->vertices = vertices;
 	mesh->numIndices = numIndices;
-	mesh->indices = indices;
-	mesh->stride = stride;
+	if(wide)
+		mesh->indices32 = (u32*)indices;
+	else
+		mesh->indices = (u16*)indices;
+	mesh->wideIndices = wide;
+	mesh->layout = layout;
+	mesh->stride = layout->stride;
+
+	mesh->maxVertices = numVertices;
+	mesh->maxIndices = numIndices;
 
 	mesh->inst = instData;
 	mesh->numInst = nInst;
@@ -266,43 +961,55 @@ CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices
 	mesh->boundSphere.FromBox(mesh->boundBox);
 
 	glCreateBuffers(1, &mesh->vbo);
-	glNamedBufferStorage(mesh->vbo, numVertices*stride + nInst*sizeof(InstData), nil, GL_DYNAMIC_STORAGE_BIT);
-	glNamedBufferSubData(mesh->vbo, 0, numVertices*stride, vertices);
-	glNamedBufferSubData(mesh->vbo, numVertices*stride, nInst*sizeof(InstData), instData);
+	glNamedBufferStorage(mesh->vbo, numVertices*mesh->stride + nInst*sizeof(InstData), nil, GL_DYNAMIC_STORAGE_BIT);
+	glNamedBufferSubData(mesh->vbo, 0, numVertices*mesh->stride, vertices);
+	glNamedBufferSubData(mesh->vbo, numVertices*mesh->stride, nInst*sizeof(InstData), instData);
 	glCreateBuffers(1, &mesh->ibo);
-	glNamedBufferStorage(mesh->ibo, numIndices*sizeof(u16), indices, GL_DYNAMIC_STORAGE_BIT);
+	glNamedBufferStorage(mesh->ibo, numIndices*mesh->IndexSize(), indices, GL_DYNAMIC_STORAGE_BIT);
 
 	glCreateVertexArrays(1, &mesh->vao);
-	glVertexArrayVertexBuffer(mesh->vao, 0, mesh->vbo, 0, stride);
-	glVertexArrayVertexBuffer(mesh->vao, 1, mesh->vbo, numVertices*stride, sizeof(InstData));
+	glVertexArrayVertexBuffer(mesh->vao, 0, mesh->vbo, 0, mesh->stride);
+	glVertexArrayVertexBuffer(mesh->vao, 1, mesh->vbo, numVertices*mesh->stride, sizeof(InstData));
 	glVertexArrayBindingDivisor(mesh->vao, 1, 1);
 	glVertexArrayElementBuffer(mesh->vao, mesh->ibo);
 
-	glEnableVertexArrayAttrib(mesh->vao, 0);
-	glEnableVertexArrayAttrib(mesh->vao, 1);
-	glEnableVertexArrayAttrib(mesh->vao, 2);
+	SetupLayout(mesh->vao, layout);
 	glEnableVertexArrayAttrib(mesh->vao, 3);
 	glEnableVertexArrayAttrib(mesh->vao, 4);
-	glVertexArrayAttribFormat(mesh->vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, pos));
-	glVertexArrayAttribFormat(mesh->vao, 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(Vertex, color));
-	glVertexArrayAttribFormat(mesh->vao, 2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv));
 	glVertexArrayAttribFormat(mesh->vao, 3, 4, GL_FLOAT, GL_FALSE, 0);
 	glVertexArrayAttribFormat(mesh->vao, 4, 2, GL_FLOAT, GL_FALSE, offsetof(InstData, uv));
-	glVertexArrayAttribBinding(mesh->vao, 0, 0);
-	glVertexArrayAttribBinding(mesh->vao, 1, 0);
-	glVertexArrayAttribBinding(mesh->vao, 2, 0);
 	glVertexArrayAttribBinding(mesh->vao, 3, 1);
 	glVertexArrayAttribBinding(mesh->vao, 4, 1);
 
 	return mesh;
 }
 
+VertexMesh*
+CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u16 *indices, const VertexLayout *layout, InstData *instData, u32 nInst)
+{
+	return MakeInstanceMesh(primType, numVertices, vertices, numIndices, indices, false, layout, instData, nInst);
+}
+
+VertexMesh*
+CreateInstanceMesh(u32 primType, u32 numVertices, void *vertices, u32 numIndices, u32 *indices, const VertexLayout *layout, InstData *instData, u32 nInst)
+{
+	if(numVertices <= 0x10000)
+		return MakeInstanceMesh(primType, numVertices, vertices, numIndices, NarrowIndices(indices, numIndices), false, layout, instData, nInst);
+	return MakeInstanceMesh(primType, numVertices, vertices, numIndices, indices, true, layout, instData, nInst);
+}
+
 void
 VertexMesh::UpdateInstanceData(void)
 {
 	glNamedBufferSubData(vbo, numVertices*stride, numInst*sizeof(InstData), inst);
 }
 
+void
+VertexMesh::UpdateInstanceData(u32 first, u32 count)
+{
+	glNamedBufferSubData(vbo, numVertices*stride + first*sizeof(InstData), count*sizeof(InstData), &inst[first]);
+}
+
 void
 VertexMesh::DrawVertices(bool active)
 {
@@ -314,7 +1021,7 @@ VertexMesh::DrawVertices(bool active)
 	glBindVertexArray(vao);
 	glEnable(GL_POLYGON_OFFSET_FILL);
 	glPolygonOffset(0.0f, -200.0f);
-	glDrawElementsInstanced(primType, numIndices, GL_UNSIGNED_SHORT, 0, numInst);
+	glDrawElementsInstanced(primType, numIndices, IndexType(), 0, numInst);
 	glDisable(GL_POLYGON_OFFSET_FILL);
 	defProg.Use();
 }
@@ -325,15 +1032,15 @@ VertexMesh::DrawVertices(bool active)
 Mesh*
 CreateCube(void)
 {
-	static Vertex vertices[] = {
-		{ { -1.0f, -1.0f, -1.0f }, {   0,   0,   0, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ { -1.0f, -1.0f,  1.0f }, {   0,   0, 255, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ { -1.0f,  1.0f, -1.0f }, {   0, 255,   0, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ { -1.0f,  1.0f,  1.0f }, {   0, 255, 255, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ {  1.0f, -1.0f, -1.0f }, { 255,   0,   0, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ {  1.0f, -1.0f,  1.0f }, { 255,   0, 255, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ {  1.0f,  1.0f, -1.0f }, { 255, 255,   0, 255 }, { 0.0f, 0.0f, 0.0f } },
-		{ {  1.0f,  1.0f,  1.0f }, { 255, 255, 255, 255 }, { 0.0f, 0.0f, 0.0f } },
+	static PackedVertex vertices[] = {
+		{ { -1.0f, -1.0f, -1.0f }, {   0,   0,   0, 255 }, 0 },
+		{ { -1.0f, -1.0f,  1.0f }, {   0,   0, 255, 255 }, 0 },
+		{ { -1.0f,  1.0f, -1.0f }, {   0, 255,   0, 255 }, 0 },
+		{ { -1.0f,  1.0f,  1.0f }, {   0, 255, 255, 255 }, 0 },
+		{ {  1.0f, -1.0f, -1.0f }, { 255,   0,   0, 255 }, 0 },
+		{ {  1.0f, -1.0f,  1.0f }, { 255,   0, 255, 255 }, 0 },
+		{ {  1.0f,  1.0f, -1.0f }, { 255, 255,   0, 255 }, 0 },
+		{ {  1.0f,  1.0f,  1.0f }, { 255, 255, 255, 255 }, 0 },
 	};
 	static u16 indices[] = {
 		0, 1, 2,
@@ -355,18 +1062,16 @@ CreateCube(void)
 		5, 0, 4
 	};
 	for(u32 i = 0; i < nelem(vertices); i++) {
-		float n = 1.0f/sqrt(sq(vertices[i].pos[0]) + sq(vertices[i].pos[1]) + sq(vertices[i].pos[2]));
-		vertices[i].normal[0] = vertices[i].pos[0]*n;
-		vertices[i].normal[1] = vertices[i].pos[1]*n;
-		vertices[i].normal[2] = vertices[i].pos[2]*n;
+		vec3 pos(vertices[i].pos[0], vertices[i].pos[1], vertices[i].pos[2]);
+		vertices[i].normal = PackNormal(normalize(pos));
 	}
 
-	Vertex *verts = new Vertex[nelem(vertices)];
+	PackedVertex *verts = new PackedVertex[nelem(vertices)];
 	u16 *inds = new u16[nelem(indices)];
 	memcpy(verts, vertices, sizeof(vertices));
 	memcpy(inds, indices, sizeof(indices));
 
-	return CreateMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, sizeof(Vertex));
+	return CreateMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, &packedVertexLayout);
 }
 
 Mesh*
@@ -377,7 +1082,7 @@ CreateTorus(float R1, float R2)
 
 	u32 numVertices = N1*N2;
 	u32 numIndices = 6*N1*N2;
-	Vertex *vertices = new Vertex[numVertices];
+	PackedVertex *vertices = new PackedVertex[numVertices];
 	u16 *indices = new u16[numIndices];
 
 	for(int i = 0; i < N1; i++) {
@@ -390,13 +1095,12 @@ CreateTorus(float R1, float R2)
 			vec3 norm = pos = rot * pos;
 			pos = R2*pos + vec3(R1*cosf(theta), R1*sinf(theta), 0.0f);
 
-			Vertex *v = &vertices[i*N2 + j];
+			PackedVertex *v = &vertices[i*N2 + j];
 			v->pos[0] = pos.x;
 			v->pos[1] = pos.y;
 			v->pos[2] = pos.z;
-			v->normal[0] = norm.x;
-			v->normal[1] = norm.y;
-			v->normal[2] = norm.z;
+			v->normal = PackNormal(norm);
+			v->uv[0] = v->uv[1] = 0;
 			v->color[0] = (norm.x+1.0f)*0.5f * 255;
 			v->color[1] = (norm.y+1.0f)*0.5f * 255;
 			v->color[2] = (norm.z+1.0f)*0.5f * 255;
@@ -419,7 +1123,7 @@ CreateTorus(float R1, float R2)
 			indices[n++] = i3;
 		}
 
-	Mesh *mesh = CreateMesh(GL_TRIANGLES, numVertices, vertices, numIndices, indices, sizeof(Vertex));
+	Mesh *mesh = CreateMesh(GL_TRIANGLES, numVertices, vertices, numIndices, indices, &packedVertexLayout);
 
 //	delete[] indices;
 //	delete[] vertices;
@@ -434,7 +1138,7 @@ CreateSphere(float R)
 
 	u32 numVertices = N*N;
 	u32 numIndices = 6*N*N;
-	Vertex *vertices = new Vertex[numVertices];
+	PackedVertex *vertices = new PackedVertex[numVertices];
 	u16 *indices = new u16[numIndices];
 
 	for(int i = 0; i < N; i++) {
@@ -443,13 +1147,12 @@ CreateSphere(float R)
 			float phi = j * TAU/N;
 		//	glm::vec3 pos(cosf(theta), sinf(theta)*cosf(phi), sinf(theta)*sinf(phi));
 			glm::vec3 pos(sinf(theta)*cosf(phi), sinf(theta)*sinf(phi), cosf(theta));
-			Vertex *v = &vertices[i*N + j];
+			PackedVertex *v = &vertices[i*N + j];
 			v->pos[0] = R*pos.x;
 			v->pos[1] = R*pos.y;
 			v->pos[2] = R*pos.z;
-			v->normal[0] = R*pos.x;
-			v->normal[1] = R*pos.y;
-			v->normal[2] = R*pos.z;
+			v->normal = PackNormal(pos);
+			v->uv[0] = v->uv[1] = 0;
 			v->color[0] = (pos.x+1.0f)*0.5f * 255;
 			v->color[1] = (pos.y+1.0f)*0.5f * 255;
 			v->color[2] = (pos.z+1.0f)*0.5f * 255;
@@ -472,7 +1175,7 @@ CreateSphere(float R)
 			indices[n++] = i3;
 		}
 
-	Mesh *mesh = CreateMesh(GL_TRIANGLES, numVertices, vertices, numIndices, indices, sizeof(Vertex));
+	Mesh *mesh = CreateMesh(GL_TRIANGLES, numVertices, vertices, numIndices, indices, &packedVertexLayout);
 
 //	delete[] indices;
 //	delete[] vertices;
@@ -488,13 +1191,13 @@ CreateGrid(void)
 
 	u32 numVertices = 4*N;
 	u32 numIndices = 4*N;
-	Vertex *vertices = new Vertex[numVertices];
+	LineVertex *vertices = new LineVertex[numVertices];
 	u16 *indices = new u16[numIndices];
 
 	float off = (N-1)*dx/2.0f;
 	int n = 0;
 	for(int i = 0; i < N; i++) {
-		Vertex *v = &vertices[n++];
+		LineVertex *v = &vertices[n++];
 		v->pos[0] = i*dx - off;
 		v->pos[1] = -off;
 		v->pos[2] = 0.0f;
@@ -516,7 +1219,7 @@ CreateGrid(void)
 		v->color[3] = 255;
 	}
 	for(int i = 0; i < N; i++) {
-		Vertex *v = &vertices[n++];
+		LineVertex *v = &vertices[n++];
 		v->pos[0] = -off;
 		v->pos[1] = i*dx - off;
 		v->pos[2] = 0.0f;
@@ -540,7 +1243,7 @@ CreateGrid(void)
 	for(u32 i = 0; i < numIndices; i++)
 		indices[i] = i;
 
-	Mesh *mesh = CreateMesh(GL_LINES, numVertices, vertices, numIndices, indices, sizeof(Vertex));
+	Mesh *mesh = CreateMesh(GL_LINES, numVertices, vertices, numIndices, indices, &lineVertexLayout);
 
 //	delete[] indices;
 //	delete[] vertices;
@@ -0,0 +1,1194 @@
+#include "ithil.h"
+
+#include <stdio.h>
+#include <float.h>
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// knot span i with knots[i] <= u < knots[i+1], clamped to [degree, numCVs-1]
+// so the end of the parameter range evaluates to the last span
+int
+FindSpan(float u, int degree, int numCVs, const float *knots)
+{
+	int n = numCVs-1;
+	if(u >= knots[n+1])
+		return n;
+	if(u <= knots[degree])
+		return degree;
+	int lo = degree;
+	int hi = n+1;
+	while(hi - lo > 1) {
+		int mid = (lo+hi)/2;
+		if(u < knots[mid])
+			hi = mid;
+		else
+			lo = mid;
+	}
+	return lo;
+}
+
+// Basis functions that are non-zero in span, N[0] belongs to CV span-degree.
+// P is the degree for the common cases so the loops unroll, 0 means any.
+template <int P, bool D> static inline void
+BasisT(float u, int span, int degree, const float *knots, float *N, float *dN)
+{
+	const int p = P > 0 ? P : degree;
+	float left[MAX_DEGREE+1], right[MAX_DEGREE+1];
+	N[0] = 1.0f;
+	if(D)
+		dN[0] = 0.0f;
+	for(int j = 1; j <= p; j++) {
+		left[j] = u - knots[span+1-j];
+		right[j] = knots[span+j] - u;
+		float saved = 0.0f;
+		float dsaved = 0.0f;
+		for(int r = 0; r < j; r++) {
+			float t = N[r]/(right[r+1] + left[j-r]);
+			N[r] = saved + right[r+1]*t;
+			saved = left[j-r]*t;
+			// only the last step matters for the derivative
+			if(D && j == p) {
+				dN[r] = dsaved - p*t;
+				dsaved = p*t;
+			}
+		}
+		N[j] = saved;
+		if(D && j == p)
+			dN[j] = dsaved;
+	}
+}
+
+void
+EvalBasis(float u, int span, int degree, const float *knots, float *N)
+{
+	assert(degree <= MAX_DEGREE);
+	switch(degree) {
+	case 1: BasisT<1,false>(u, span, degree, knots, N, nil); break;
+	case 2: BasisT<2,false>(u, span, degree, knots, N, nil); break;
+	case 3: BasisT<3,false>(u, span, degree, knots, N, nil); break;
+	default: BasisT<0,false>(u, span, degree, knots, N, nil); break;
+	}
+}
+
+// same as EvalBasis but also returns first derivatives in dN
+void
+EvalBasisDerivs(float u, int span, int degree, const float *knots, float *N, float *dN)
+{
+	assert(degree <= MAX_DEGREE);
+	switch(degree) {
+	case 1: BasisT<1,true>(u, span, degree, knots, N, dN); break;
+	case 2: BasisT<2,true>(u, span, degree, knots, N, dN); break;
+	case 3: BasisT<3,true>(u, span, degree, knots, N, dN); break;
+	default: BasisT<0,true>(u, span, degree, knots, N, dN); break;
+	}
+}
+
+// first interval i with knots[i] <= u <= knots[i+1], -1 if outside
+int
+FindInterval(float u, int numKnots, const float *knots)
+{
+	int i = std::lower_bound(knots, knots+numKnots, u) - knots;
+	if(i == numKnots)
+		return -1;
+	if(i == 0)
+		return knots[0] == u ? 0 : -1;
+	return i-1;
+}
+
+// false if the tangents are (nearly) zero or parallel,
+// as happens at collapsed edges
+bool
+NormalFromDerivs(vec3 du, vec3 dv, vec3 *n)
+{
+	vec3 c = cross(du, dv);
+	float len = length(c);
+	if(len <= 1.0e-5f*max(dot(du, du), dot(dv, dv)) || len == 0.0f)
+		return false;
+	*n = c/len;
+	return true;
+}
+
+// Object space length of a number of pixels on screen at the near side
+// of the bounding sphere of an object drawn with matrix.
+// 0 if the object is too close or there is no projection yet.
+float
+PixelsToObject(float pixels, const mat4 &matrix, const Sphere &sphere)
+{
+	if(display_h <= 0 || proj[1][1] == 0.0f)
+		return 0.0f;
+	float scale = std::max(length(vec3(matrix[0])), std::max(length(vec3(matrix[1])), length(vec3(matrix[2]))));
+	if(scale == 0.0f)
+		return 0.0f;
+	float dist = 1.0f;
+	// perspective projection: pixels grow with distance
+	if(proj[2][3] != 0.0f) {
+		vec3 center = vec3(matrix * vec4(sphere.center, 1.0f));
+		dist = length(center - eyePos) - sphere.radius*scale;
+		if(dist <= 0.0f)
+			return 0.0f;
+	}
+	return pixels * 2.0f*dist/(proj[1][1]*display_h) / scale;
+}
+
+// Level l of detail tessellates with 2^l times the base tolerance.
+// A finer level is kept until the view is lodHysteresis levels past
+// the next coarser one, so objects don't flip between two levels.
+float lodHysteresis = 0.25f;
+
+// Continuous level at which pixels on screen are no coarser than
+// the level's tolerance, 0 if base is finer than that already
+float
+DetailLevel(float pixels, const mat4 &matrix, const Sphere &sphere, float base)
+{
+	float len = PixelsToObject(pixels, matrix, sphere);
+	if(base <= 0.0f || len <= base)
+		return 0.0f;
+	return std::min(log2f(len/base), (float)(MAX_LOD_LEVELS-1));
+}
+
+// Discrete level for x, current (-1 for none) if it is fine enough
+// and x is still close to it
+int
+SelectLevel(float x, int current)
+{
+	if(current >= 0 && x >= current && x < current+1 + lodHysteresis)
+		return current;
+	return clamp((int)floorf(x), 0, MAX_LOD_LEVELS-1);
+}
+
+// Segments for a piece of curve with |C''|/8 <= K (over unit parameter length)
+// so that its chords are within tol
+int
+SegmentsForTolerance(float K, float tol)
+{
+	if(K <= 0.0f)
+		return 1;
+	if(tol <= 0.0f)
+		return MAX_SEGMENTS;
+	return clamp((int)ceilf(sqrtf(K/tol)), 1, MAX_SEGMENTS);
+}
+
+void
+BasisTable::Build(const float *u, int n, int degree, int numCVs, const float *knots)
+{
+	this->degree = degree;
+	numSamples = n;
+	if(u)
+		params.assign(u, u+n);
+	spans.resize(n);
+	basis.resize(n*(degree+1));
+	derivs.resize(n*(degree+1));
+	for(int i = 0; i < n; i++) {
+		spans[i] = FindSpan(params[i], degree, numCVs, knots);
+		EvalBasisDerivs(params[i], spans[i], degree, knots, &basis[i*(degree+1)], &derivs[i*(degree+1)]);
+	}
+}
+
+// n samples evenly spaced over the domain [knots[degree], knots[numCVs]]
+void
+BasisTable::BuildUniform(int n, int degree, int numCVs, const float *knots)
+{
+	float minU = knots[degree];
+	float maxU = knots[numCVs];
+	params.resize(n);
+	for(int i = 0; i < n; i++)
+		params[i] = minU + (maxU-minU)*i/(n-1);
+	params[n-1] = maxU;
+	Build(nil, n, degree, numCVs, knots);
+}
+
+
+// samples [first,end) with u0 <= params[i] <= u1, params have to be sorted
+void
+BasisTable::FindSamples(float u0, float u1, int *first, int *end) const
+{
+	*first = std::lower_bound(params.begin(), params.end(), u0) - params.begin();
+	*end = std::upper_bound(params.begin(), params.end(), u1) - params.begin();
+}
+
+// A lane per parameter: up to LANES samples of one knot span
+// are evaluated together, the knots and CVs of the span are
+// broadcast to all lanes.
+#ifdef __AVX2__
+#define LANES 8
+typedef __m256 lvec;
+static inline lvec lset(float f) { return _mm256_set1_ps(f); }
+static inline lvec lload(const float *p) { return _mm256_loadu_ps(p); }
+static inline void lstore(float *p, lvec a) { _mm256_storeu_ps(p, a); }
+static inline lvec ladd(lvec a, lvec b) { return _mm256_add_ps(a, b); }
+static inline lvec lsub(lvec a, lvec b) { return _mm256_sub_ps(a, b); }
+static inline lvec lmul(lvec a, lvec b) { return _mm256_mul_ps(a, b); }
+static inline lvec ldiv(lvec a, lvec b) { return _mm256_div_ps(a, b); }
+static inline lvec lmax(lvec a, lvec b) { return _mm256_max_ps(a, b); }
+static inline lvec lsqrt(lvec a) { return _mm256_sqrt_ps(a); }
+#ifdef __FMA__
+static inline lvec lmadd(lvec acc, lvec a, lvec b) { return _mm256_fmadd_ps(a, b, acc); }
+#else
+static inline lvec lmadd(lvec acc, lvec a, lvec b) { return _mm256_add_ps(acc, _mm256_mul_ps(a, b)); }
+#endif
+#elif defined(__SSE__)
+#define LANES 4
+typedef __m128 lvec;
+static inline lvec lset(float f) { return _mm_set1_ps(f); }
+static inline lvec lload(const float *p) { return _mm_loadu_ps(p); }
+static inline void lstore(float *p, lvec a) { _mm_storeu_ps(p, a); }
+static inline lvec ladd(lvec a, lvec b) { return _mm_add_ps(a, b); }
+static inline lvec lsub(lvec a, lvec b) { return _mm_sub_ps(a, b); }
+static inline lvec lmul(lvec a, lvec b) { return _mm_mul_ps(a, b); }
+static inline lvec ldiv(lvec a, lvec b) { return _mm_div_ps(a, b); }
+static inline lvec lmax(lvec a, lvec b) { return _mm_max_ps(a, b); }
+static inline lvec lsqrt(lvec a) { return _mm_sqrt_ps(a); }
+static inline lvec lmadd(lvec acc, lvec a, lvec b) { return _mm_add_ps(acc, _mm_mul_ps(a, b)); }
+#else
+#define LANES 1
+typedef float lvec;
+static inline lvec lset(float f) { return f; }
+static inline lvec lload(const float *p) { return *p; }
+static inline void lstore(float *p, lvec a) { *p = a; }
+static inline lvec ladd(lvec a, lvec b) { return a + b; }
+static inline lvec lsub(lvec a, lvec b) { return a - b; }
+static inline lvec lmul(lvec a, lvec b) { return a * b; }
+static inline lvec ldiv(lvec a, lvec b) { return a / b; }
+static inline lvec lmax(lvec a, lvec b) { return a > b ? a : b; }
+static inline lvec lsqrt(lvec a) { return sqrtf(a); }
+static inline lvec lmadd(lvec acc, lvec a, lvec b) { return acc + a*b; }
+#endif
+
+#define CV(cvs, stride, i) ((const vec4*)((const u8*)(cvs) + (i)*(stride)))
+
+// BasisT for a parameter per lane, all in span
+template <int P> static inline void
+BasisLanes(lvec u, int span, int degree, const float *knots, lvec *N)
+{
+	const int p = P > 0 ? P : degree;
+	lvec left[MAX_DEGREE+1], right[MAX_DEGREE+1];
+	N[0] = lset(1.0f);
+	for(int j = 1; j <= p; j++) {
+		left[j] = lsub(u, lset(knots[span+1-j]));
+		right[j] = lsub(lset(knots[span+j]), u);
+		lvec saved = lset(0.0f);
+		for(int r = 0; r < j; r++) {
+			lvec t = ldiv(N[r], ladd(right[r+1], left[j-r]));
+			N[r] = lmadd(saved, right[r+1], t);
+			saved = lmul(left[j-r], t);
+		}
+		N[j] = saved;
+	}
+}
+
+// FindSpan(u, degree, numCVs, knots) == span for a span it returned
+static inline bool
+InSpan(float u, int span, int degree, int numCVs, const float *knots)
+{
+	return (span == degree || u >= knots[span]) && (span == numCVs-1 || u < knots[span+1]);
+}
+
+template <int P> static void
+CurveT(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots,
+	const float *u, int n, vec3 *out, u32 outStride)
+{
+	const int p = P > 0 ? P : degree;
+	float ul[LANES];
+	float x[4][LANES];
+	for(int s = 0; s < n;) {
+		// the following samples in the same span, the other lanes repeat the last
+		int span = FindSpan(u[s], p, numCVs, knots);
+		int m = 1;
+		while(m < LANES && s+m < n && InSpan(u[s+m], span, p, numCVs, knots))
+			m++;
+		for(int l = 0; l < LANES; l++)
+			ul[l] = u[s + min(l, m-1)];
+		lvec N[MAX_DEGREE+1];
+		BasisLanes<P>(lload(ul), span, p, knots, N);
+		lvec C[4] = { lset(0.0f), lset(0.0f), lset(0.0f), lset(0.0f) };
+		for(int k = 0; k <= p; k++) {
+			const vec4 *cv = CV(cvs, cvStride, span-p+k);
+			for(int c = 0; c < 4; c++)
+				C[c] = lmadd(C[c], N[k], lset((*cv)[c]));
+		}
+		for(int c = 0; c < 3; c++)
+			lstore(x[c], ldiv(C[c], C[3]));
+		for(int l = 0; l < m; l++)
+			*(vec3*)((u8*)out + (s+l)*outStride) = vec3(x[0][l], x[1][l], x[2][l]);
+		s += m;
+	}
+}
+
+// Evaluate a curve at n parameters, out is outStride bytes apart.
+// Runs of parameters in one knot span go through the lanes together.
+void
+EvalCurveBatch(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots,
+	const float *u, int n, vec3 *out, u32 outStride)
+{
+	assert(degree <= MAX_DEGREE);
+	switch(degree) {
+	case 1: CurveT<1>(cvs, cvStride, degree, numCVs, knots, u, n, out, outStride); break;
+	case 2: CurveT<2>(cvs, cvStride, degree, numCVs, knots, u, n, out, outStride); break;
+	case 3: CurveT<3>(cvs, cvStride, degree, numCVs, knots, u, n, out, outStride); break;
+	default: CurveT<0>(cvs, cvStride, degree, numCVs, knots, u, n, out, outStride); break;
+	}
+}
+
+// The scratch floats of GridT, the CV block and the collapsed rows
+// are component arrays of stride floats per row
+struct GridScratch
+{
+	int c0, c1, r0, r1;	// CV columns and rows
+	int stride;	// c1-c0 rounded up to the lanes
+	float *cvs[4];
+	float *row[4];	// CV rows collapsed in v
+	float *drow[4];	// and their v-derivatives
+	float *basis;	// (degree+1) arrays of the u samples
+	float *derivs;
+};
+
+template <int P, int Q> static void
+GridT(const BasisTable &tu, const BasisTable &tv, vec3 *pos, u32 *normals,
+	u32 strideU, u32 strideV, const GridScratch &g, int u0, int u1, int v0, int v1)
+{
+	const int p = P > 0 ? P : tu.degree;
+	const int q = Q > 0 ? Q : tv.degree;
+	int nu = u1-u0;
+	float x[12][LANES];
+	for(int iv = v0; iv < v1; iv++) {
+		// collapse the q+1 CV rows into a curve in u and its v-derivative,
+		// a lane per CV column
+		const float *bv = tv.Basis(iv);
+		const float *dbv = tv.Derivs(iv);
+		int r = tv.spans[iv]-q - g.r0;
+		for(int c = 0; c < 4; c++)
+			for(int i = 0; i < g.stride; i += LANES) {
+				lvec C = lset(0.0f);
+				lvec Cd = lset(0.0f);
+				for(int j = 0; j <= q; j++) {
+					lvec X = lload(&g.cvs[c][(r+j)*g.stride + i]);
+					C = lmadd(C, lset(bv[j]), X);
+					Cd = lmadd(Cd, lset(dbv[j]), X);
+				}
+				lstore(&g.row[c][i], C);
+				lstore(&g.drow[c][i], Cd);
+			}
+
+		u8 *prow = (u8*)pos + iv*strideV;
+		u8 *nrow = normals ? (u8*)normals + iv*strideV : nil;
+#define OUT(type, row, iu) ((type*)((row) + (iu)*strideU))
+		for(int iu = u0; iu < u1;) {
+			// a lane per sample of one span
+			int span = tu.spans[iu];
+			int m = 1;
+			while(m < LANES && iu+m < u1 && tu.spans[iu+m] == span)
+				m++;
+			int k0 = span-p - g.c0;
+			lvec S[4], Su[4], Sv[4];
+			for(int c = 0; c < 4; c++) {
+				S[c] = Su[c] = Sv[c] = lset(0.0f);
+				for(int k = 0; k <= p; k++) {
+					lvec B = lload(&g.basis[k*nu + iu-u0]);
+					lvec C = lset(g.row[c][k0+k]);
+					S[c] = lmadd(S[c], B, C);
+					Su[c] = lmadd(Su[c], lload(&g.derivs[k*nu + iu-u0]), C);
+					Sv[c] = lmadd(Sv[c], B, lset(g.drow[c][k0+k]));
+				}
+			}
+			lvec w = S[3];
+			lvec P3[3], du[3], dv[3];
+			for(int c = 0; c < 3; c++) {
+				P3[c] = ldiv(S[c], w);
+				du[c] = ldiv(lsub(Su[c], lmul(P3[c], Su[3])), w);
+				dv[c] = ldiv(lsub(Sv[c], lmul(P3[c], Sv[3])), w);
+				lstore(x[c], P3[c]);
+			}
+			if(normals) {
+				// NormalFromDerivs
+				lvec n[3];
+				n[0] = lsub(lmul(du[1], dv[2]), lmul(du[2], dv[1]));
+				n[1] = lsub(lmul(du[2], dv[0]), lmul(du[0], dv[2]));
+				n[2] = lsub(lmul(du[0], dv[1]), lmul(du[1], dv[0]));
+				lvec len = lsqrt(lmadd(lmadd(lmul(n[0], n[0]), n[1], n[1]), n[2], n[2]));
+				lvec uu = lmadd(lmadd(lmul(du[0], du[0]), du[1], du[1]), du[2], du[2]);
+				lvec vv = lmadd(lmadd(lmul(dv[0], dv[0]), dv[1], dv[1]), dv[2], dv[2]);
+				// scaled for PackNormal and offset so truncation rounds
+				for(int c = 0; c < 3; c++)
+					lstore(x[3+c], lmadd(lset(512.5f), ldiv(n[c], len), lset(511.0f)));
+				lstore(x[6], len);
+				lstore(x[7], lmul(lset(1.0e-5f), lmax(uu, vv)));
+			}
+			for(int l = 0; l < m; l++) {
+				*OUT(vec3, prow, iu+l) = vec3(x[0][l], x[1][l], x[2][l]);
+				if(nrow) {
+					bool ok = x[6][l] > x[7][l] && x[6][l] != 0.0f;
+					u32 nx = ((u32)x[3][l] - 512) & 0x3FF;
+					u32 ny = ((u32)x[4][l] - 512) & 0x3FF;
+					u32 nz = ((u32)x[5][l] - 512) & 0x3FF;
+					*OUT(u32, nrow, iu+l) = ok ? nx | ny<<10 | nz<<20 : 0;
+				}
+			}
+			iu += m;
+		}
+#undef OUT
+	}
+}
+
+// Evaluate a tensor product surface at samples [u0,u1) x [v0,v1) of tu x tv.
+// cvs are homogeneous, numU per row and cvStride bytes apart,
+// output goes to pos (and normals if not nil) at iu*strideU + iv*strideV.
+// Normals are packed by PackNormal, 0 where the tangents don't determine one.
+// The CVs the samples depend on are transposed into scratch once,
+// then LANES samples are evaluated at a time.
+void
+EvalSurfaceGridRange(const vec4 *cvs, u32 cvStride, int numU, const BasisTable &tu, const BasisTable &tv,
+	vec3 *pos, u32 *normals, u32 strideU, u32 strideV, std::vector<float> &scratch,
+	int u0, int u1, int v0, int v1)
+{
+	if(u0 >= u1 || v0 >= v1)
+		return;
+	int p = tu.degree;
+	int q = tv.degree;
+	GridScratch g;
+	g.c0 = numU;
+	g.c1 = 0;
+	for(int iu = u0; iu < u1; iu++) {
+		g.c0 = min(g.c0, tu.spans[iu]-p);
+		g.c1 = max(g.c1, tu.spans[iu]+1);
+	}
+	g.r0 = 1<<30;
+	g.r1 = 0;
+	for(int iv = v0; iv < v1; iv++) {
+		g.r0 = min(g.r0, tv.spans[iv]-q);
+		g.r1 = max(g.r1, tv.spans[iv]+1);
+	}
+	g.stride = (g.c1-g.c0 + LANES-1)/LANES*LANES;
+	int nu = u1-u0;
+	// samples past u1 are loaded into the unused lanes
+	int nb = (p+1)*nu + LANES;
+	int nr = g.r1-g.r0;
+	u32 size = 4*nr*g.stride + 8*g.stride + 2*nb;
+	if(scratch.size() < size)
+		scratch.resize(size);
+	float *f = &scratch[0];
+	for(int c = 0; c < 4; c++, f += nr*g.stride)
+		g.cvs[c] = f;
+	for(int c = 0; c < 4; c++, f += g.stride)
+		g.row[c] = f;
+	for(int c = 0; c < 4; c++, f += g.stride)
+		g.drow[c] = f;
+	g.basis = f;
+	g.derivs = f + nb;
+
+	for(int r = 0; r < nr; r++) {
+		const vec4 *row = CV(cvs, cvStride, (g.r0+r)*numU);
+		for(int i = 0; i < g.stride; i++) {
+			vec4 cv = g.c0+i < g.c1 ? *CV(row, cvStride, g.c0+i) : vec4(0.0f);
+			for(int c = 0; c < 4; c++)
+				g.cvs[c][r*g.stride + i] = cv[c];
+		}
+	}
+	for(int iu = u0; iu < u1; iu++)
+		for(int k = 0; k <= p; k++) {
+			g.basis[k*nu + iu-u0] = tu.Basis(iu)[k];
+			g.derivs[k*nu + iu-u0] = tu.Derivs(iu)[k];
+		}
+	for(int i = (p+1)*nu; i < nb; i++)
+		g.basis[i] = g.derivs[i] = 0.0f;
+
+	if(tu.degree == tv.degree && tu.degree == 1)
+		GridT<1,1>(tu, tv, pos, normals, strideU, strideV, g, u0, u1, v0, v1);
+	else if(tu.degree == tv.degree && tu.degree == 2)
+		GridT<2,2>(tu, tv, pos, normals, strideU, strideV, g, u0, u1, v0, v1);
+	else if(tu.degree == tv.degree && tu.degree == 3)
+		GridT<3,3>(tu, tv, pos, normals, strideU, strideV, g, u0, u1, v0, v1);
+	else
+		GridT<0,0>(tu, tv, pos, normals, strideU, strideV, g, u0, u1, v0, v1);
+}
+
+#define OUTCV(cvs, stride, i) ((vec4*)((u8*)(cvs) + (i)*(stride)))
+
+// Insert u r times (Boehm), at most until it has multiplicity degree.
+// newKnots and newCVs have room for r more than knots and cvs.
+// Returns the number of insertions done.
+int
+InsertKnot(float u, int r, int degree, int numCVs, const float *knots, const vec4 *cvs, u32 cvStride,
+	float *newKnots, vec4 *newCVs, u32 newStride)
+{
+	int p = degree;
+	int k = FindSpan(u, p, numCVs, knots);
+	int s = 0;
+	for(int i = k; i >= 0 && knots[i] == u; i--)
+		s++;
+	// only inside the domain
+	if(u <= knots[p] || u >= knots[numCVs])
+		r = 0;
+	r = std::max(std::min(r, p-s), 0);
+	int numKnots = numCVs+p+1;
+	for(int i = 0; i <= k; i++)
+		newKnots[i] = knots[i];
+	for(int i = 1; i <= r; i++)
+		newKnots[k+i] = u;
+	for(int i = k+1; i < numKnots; i++)
+		newKnots[i+r] = knots[i];
+	if(r == 0) {
+		for(int i = 0; i < numCVs; i++)
+			*OUTCV(newCVs, newStride, i) = *CV(cvs, cvStride, i);
+		return 0;
+	}
+	for(int i = 0; i <= k-p; i++)
+		*OUTCV(newCVs, newStride, i) = *CV(cvs, cvStride, i);
+	for(int i = k-s; i < numCVs; i++)
+		*OUTCV(newCVs, newStride, i+r) = *CV(cvs, cvStride, i);
+
+	vec4 R[MAX_DEGREE+1];
+	for(int i = 0; i <= p-s; i++)
+		R[i] = *CV(cvs, cvStride, k-p+i);
+	int L = 0;
+	for(int j = 1; j <= r; j++) {
+		L = k-p+j;
+		for(int i = 0; i <= p-j-s; i++) {
+			float a = (u - knots[L+i]) / (knots[i+k+1] - knots[L+i]);
+			R[i] = a*R[i+1] + (1.0f-a)*R[i];
+		}
+		*OUTCV(newCVs, newStride, L) = R[0];
+		*OUTCV(newCVs, newStride, k+r-j-s) = R[p-j-s];
+	}
+	for(int i = L+1; i < k-s; i++)
+		*OUTCV(newCVs, newStride, i) = R[i-L];
+	return r;
+}
+
+// Number of non-empty knot spans, their boundaries go to breaks if not nil
+int
+CountSegments(int degree, int numCVs, const float *knots, float *breaks)
+{
+	int n = 0;
+	for(int i = degree; i < numCVs; i++)
+		if(knots[i+1] > knots[i]) {
+			if(breaks) {
+				breaks[n] = knots[i];
+				breaks[n+1] = knots[i+1];
+			}
+			n++;
+		}
+	return n;
+}
+
+// Bezier segments of a curve with clamped knots by knot refinement,
+// degree+1 CVs each go to out. Returns the number of segments.
+int
+DecomposeCurve(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots,
+	vec4 *out, u32 outStride)
+{
+	int p = degree;
+	int m = numCVs+p;
+	assert(knots[0] == knots[p] && knots[m-p] == knots[m]);
+	float alpha[MAX_DEGREE+1];
+	int a = p;
+	int b = p+1;
+	int nb = 0;
+	vec4 *Q = out;
+	for(int i = 0; i <= p; i++)
+		*OUTCV(Q, outStride, i) = *CV(cvs, cvStride, i);
+	while(b < m) {
+		int i = b;
+		while(b < m && knots[b+1] == knots[b])
+			b++;
+		int mult = b-i+1;
+		vec4 *next = OUTCV(Q, outStride, p+1);
+		if(mult < p) {
+			float numer = knots[b] - knots[a];
+			for(int j = p; j > mult; j--)
+				alpha[j-mult-1] = numer / (knots[a+j] - knots[a]);
+			int r = p-mult;
+			for(int j = 1; j <= r; j++) {
+				int s = mult+j;
+				for(int k = p; k >= s; k--) {
+					float t = alpha[k-s];
+					*OUTCV(Q, outStride, k) = t**OUTCV(Q, outStride, k) + (1.0f-t)**OUTCV(Q, outStride, k-1);
+				}
+				if(b < m)
+					*OUTCV(next, outStride, r-j) = *OUTCV(Q, outStride, p);
+			}
+		}
+		nb++;
+		if(b < m) {
+			for(int j = std::max(p-mult, 0); j <= p; j++)
+				*OUTCV(next, outStride, j) = *CV(cvs, cvStride, b-p+j);
+			Q = next;
+			a = b;
+			b++;
+		}
+	}
+	return nb;
+}
+
+// Bezier segments or patches of a curve or surface,
+// surfaces are decomposed along u first, then along v.
+void
+BezierForm::FromSurface(const vec4 *cvs, u32 cvStride, int degreeU, int degreeV, int numCVsU, int numCVsV,
+	const float *knotsU, const float *knotsV)
+{
+	this->degreeU = degreeU;
+	this->degreeV = degreeV;
+	breaksU.resize(numCVsU+1);
+	breaksV.resize(numCVsV+1);
+	numU = CountSegments(degreeU, numCVsU, knotsU, &breaksU[0]);
+	numV = degreeV > 0 ? CountSegments(degreeV, numCVsV, knotsV, &breaksV[0]) : 1;
+	breaksU.resize(numU+1);
+	breaksV.resize(numV+1);
+	if(degreeV == 0) {
+		breaksV[0] = 0.0f;
+		breaksV[1] = 0.0f;
+	}
+	int w = Width();
+	// rows in u into the numCVsV first rows of CVs, then every column in v
+	CVs.resize(w*std::max(numCVsV, Height()));
+	for(int j = 0; j < numCVsV; j++)
+		DecomposeCurve(CV(cvs, cvStride, j*numCVsU), cvStride, degreeU, numCVsU, knotsU,
+			&CVs[j*w], sizeof(vec4));
+	bounds.clear();
+	if(degreeV == 0) {
+		BuildBounds(0, 0, numU, numV);
+		return;
+	}
+	std::vector<vec4> column(numCVsV);
+	for(int i = 0; i < w; i++) {
+		for(int j = 0; j < numCVsV; j++)
+			column[j] = CVs[j*w + i];
+		DecomposeCurve(&column[0], sizeof(vec4), degreeV, numCVsV, knotsV,
+			&CVs[i], w*sizeof(vec4));
+	}
+	CVs.resize(w*Height());
+	BuildBounds(0, 0, numU, numV);
+}
+
+void
+BezierForm::FromCurve(const vec4 *cvs, u32 cvStride, int degree, int numCVs, const float *knots)
+{
+	FromSurface(cvs, cvStride, degree, 0, numCVs, 1, knots, nil);
+}
+
+// Bernstein polynomials of degree p at s and their derivatives
+static void
+Bernstein(float s, int p, float *B, float *dB)
+{
+	float lower[MAX_DEGREE+1];
+	B[0] = 1.0f;
+	lower[0] = 1.0f;
+	for(int k = 1; k <= p; k++) {
+		if(k == p)
+			for(int j = 0; j < p; j++)
+				lower[j] = B[j];
+		B[k] = s*B[k-1];
+		for(int j = k-1; j > 0; j--)
+			B[j] = s*B[j-1] + (1.0f-s)*B[j];
+		B[0] *= 1.0f-s;
+	}
+	for(int i = 0; i <= p; i++)
+		dB[i] = p == 0 ? 0.0f : p*((i > 0 ? lower[i-1] : 0.0f) - (i < p ? lower[i] : 0.0f));
+}
+
+// Position and derivatives of a rational Bezier patch
+static void
+EvalPatch(const vec4 *cvs, u32 cvStride, int width, int p, int q, float s, float t,
+	vec3 *pos, vec3 *ds, vec3 *dt)
+{
+	float Bs[MAX_DEGREE+1], dBs[MAX_DEGREE+1];
+	float Bt[MAX_DEGREE+1], dBt[MAX_DEGREE+1];
+	Bernstein(s, p, Bs, dBs);
+	Bernstein(t, q, Bt, dBt);
+	vec4 S(0.0f), Ss(0.0f), St(0.0f);
+	for(int j = 0; j <= q; j++) {
+		vec4 P(0.0f), Ps(0.0f);
+		for(int i = 0; i <= p; i++) {
+			const vec4 &cv = *CV(cvs, cvStride, j*width + i);
+			P += Bs[i]*cv;
+			Ps += dBs[i]*cv;
+		}
+		S += Bt[j]*P;
+		Ss += Bt[j]*Ps;
+		St += dBt[j]*P;
+	}
+	*pos = vec3(S)/S.w;
+	*ds = (vec3(Ss) - *pos*Ss.w)/S.w;
+	*dt = (vec3(St) - *pos*St.w)/S.w;
+}
+
+// Split a (p+1)x(q+1) patch in half along s or t by de Casteljau
+static void
+SplitPatch(const vec4 *h, int p, int q, bool alongS, vec4 *lo, vec4 *hi)
+{
+	int n = alongS ? p : q;
+	int lines = alongS ? q+1 : p+1;
+	int step = alongS ? 1 : p+1;
+	int lineStep = alongS ? p+1 : 1;
+	vec4 tmp[MAX_DEGREE+1];
+	for(int l = 0; l < lines; l++) {
+		for(int i = 0; i <= n; i++)
+			tmp[i] = h[l*lineStep + i*step];
+		lo[l*lineStep] = tmp[0];
+		hi[l*lineStep + n*step] = tmp[n];
+		for(int k = 1; k <= n; k++) {
+			for(int i = 0; i <= n-k; i++)
+				tmp[i] = 0.5f*(tmp[i] + tmp[i+1]);
+			lo[l*lineStep + k*step] = tmp[0];
+			hi[l*lineStep + (n-k)*step] = tmp[n-k];
+		}
+	}
+}
+
+// The ray in patch space: two planes through it and its parameter
+struct RayPatch
+{
+	const vec4 *cvs;
+	u32 cvStride;
+	int width, p, q;
+	vec4 plane1, plane2, depth;
+	float depthScale;	// length of dir, depth times it is a distance
+	float newtonSize;	// Newton is tried on pieces this small
+	float leafSize;
+	float t, s, u;	// closest hit so far
+	bool hit;
+};
+
+// Newton on the two plane distances starting from the middle of
+// [s0,s1] x [u0,u1], the hit counts if it stays in there
+// and ends up closer to the ray than leafSize.
+// Stuck on the border of the patch the hit is likely in the next one.
+static bool
+RefineHit(RayPatch &r, float s0, float s1, float u0, float u1)
+{
+	float s = (s0+s1)/2.0f;
+	float u = (u0+u1)/2.0f;
+	// hits on the border of two pieces count for both
+	float es = (s1-s0)*1e-3f;
+	float eu = (u1-u0)*1e-3f;
+	bool clamped = false;
+	for(int i = 0;; i++) {
+		vec3 P, Ps, Pu;
+		EvalPatch(r.cvs, r.cvStride, r.width, r.p, r.q, s, u, &P, &Ps, &Pu);
+		float f1 = dot(vec3(r.plane1), P) + r.plane1.w;
+		float f2 = dot(vec3(r.plane2), P) + r.plane2.w;
+		float f = max(fabsf(f1), fabsf(f2));
+		if(f < r.leafSize*1e-3f || i == 8) {
+			float t = dot(vec3(r.depth), P) + r.depth.w;
+			if(f >= r.leafSize || (clamped && f >= r.leafSize*1e-3f) || t < 0.0f || t >= r.t ||
+			   s < s0-es || s > s1+es || u < u0-eu || u > u1+eu)
+				return false;
+			r.t = t;
+			r.s = s;
+			r.u = u;
+			r.hit = true;
+			return true;
+		}
+		float a = dot(vec3(r.plane1), Ps);
+		float b = dot(vec3(r.plane1), Pu);
+		float c = dot(vec3(r.plane2), Ps);
+		float d = dot(vec3(r.plane2), Pu);
+		float det = a*d - b*c;
+		if(det == 0.0f)
+			return false;
+		float ns = s - (d*f1 - b*f2)/det;
+		float nu = u - (a*f2 - c*f1)/det;
+		clamped = ns < 0.0f || ns > 1.0f || nu < 0.0f || nu > 1.0f;
+		s = clamp(ns, 0.0f, 1.0f);
+		u = clamp(nu, 0.0f, 1.0f);
+	}
+	return false;
+}
+
+// Largest distance of the CVs of a piece from the bilinear patch
+// through its corners, relative to the size of the piece
+static float
+Flatness(const RayPatch &r, const vec4 *h, vec3 inf, vec3 sup)
+{
+	vec3 scale(1.0f, 1.0f, r.depthScale);
+	vec3 c00 = vec3(h[0])/h[0].w*scale;
+	vec3 c10 = vec3(h[r.p])/h[r.p].w*scale;
+	vec3 c01 = vec3(h[r.q*(r.p+1)])/h[r.q*(r.p+1)].w*scale;
+	vec3 c11 = vec3(h[r.q*(r.p+1) + r.p])/h[r.q*(r.p+1) + r.p].w*scale;
+	float dev = 0.0f;
+	for(int j = 0; j <= r.q; j++) {
+		float b = r.q > 0 ? (float)j/r.q : 0.0f;
+		for(int i = 0; i <= r.p; i++) {
+			float a = r.p > 0 ? (float)i/r.p : 0.0f;
+			vec3 x = vec3(h[j*(r.p+1) + i])/h[j*(r.p+1) + i].w*scale;
+			vec3 bilin = (1.0f-b)*((1.0f-a)*c00 + a*c10) + b*((1.0f-a)*c01 + a*c11);
+			dev = max(dev, length(x - bilin));
+		}
+	}
+	float size = length((sup - inf)*scale);
+	return size > 0.0f ? dev/size : 0.0f;
+}
+
+// h are the CVs projected onto (plane1, plane2, depth, w) for [s0,s1] x [u0,u1]
+static void
+ClipPatch(RayPatch &r, const vec4 *h, float s0, float s1, float u0, float u1, int depth)
+{
+	vec3 inf(FLT_MAX), sup(-FLT_MAX);
+	for(int i = 0; i < (r.p+1)*(r.q+1); i++) {
+		vec3 x = vec3(h[i])/h[i].w;
+		inf = glm::min(inf, x);
+		sup = glm::max(sup, x);
+	}
+	if(inf.x > 0.0f || sup.x < 0.0f || inf.y > 0.0f || sup.y < 0.0f ||
+	   sup.z < 0.0f || inf.z >= r.t)
+		return;
+	float s = (s0+s1)/2.0f;
+	float u = (u0+u1)/2.0f;
+	float size = max(sup.x-inf.x, sup.y-inf.y);
+	// a nearly flat or small piece is crossed once, Newton finds that
+	if((size < r.newtonSize || Flatness(r, h, inf, sup) < 1e-2f) &&
+	   RefineHit(r, s0, s1, u0, u1))
+		return;
+	// Newton can fail near silhouettes, keep splitting then
+	if(size < r.leafSize*1e-2f) {
+		// a tiny piece will do
+		r.t = max(inf.z, 0.0f);
+		r.s = s;
+		r.u = u;
+		r.hit = true;
+		return;
+	}
+	if(depth >= 40)
+		return;
+	vec4 lo[(MAX_DEGREE+1)*(MAX_DEGREE+1)];
+	vec4 hi[(MAX_DEGREE+1)*(MAX_DEGREE+1)];
+	bool alongS = s1-s0 >= u1-u0;
+	SplitPatch(h, r.p, r.q, alongS, lo, hi);
+	// near half first, it makes the far one likelier to be culled
+	float dlo = FLT_MAX, dhi = FLT_MAX;
+	for(int i = 0; i < (r.p+1)*(r.q+1); i++) {
+		dlo = min(dlo, lo[i].z/lo[i].w);
+		dhi = min(dhi, hi[i].z/hi[i].w);
+	}
+	bool loFirst = dlo <= dhi;
+	for(int k = 0; k < 2; k++) {
+		bool doLo = (k == 0) == loFirst;
+		if(alongS)
+			ClipPatch(r, doLo ? lo : hi, doLo ? s0 : s, doLo ? s : s1, u0, u1, depth+1);
+		else
+			ClipPatch(r, doLo ? lo : hi, s0, s1, doLo ? u0 : u, doLo ? u : u1, depth+1);
+	}
+}
+
+// Closest hit of the ray orig + t*dir, t >= 0, with a rational Bezier patch
+// of degree p x q whose CV (i,j) is j*width + i. Subdivides until the pieces
+// around the ray are nearly flat or small, then refines the hit by Newton
+// iteration. Pieces where that fails are split further.
+// Only hits closer than t are reported, (s,u) is the hit in [0,1]^2.
+bool
+IntersectRayPatch(const vec4 *cvs, u32 cvStride, int width, int p, int q, vec3 orig, vec3 dir,
+	float &t, float &s, float &u)
+{
+	RayPatch r;
+	r.cvs = cvs;
+	r.cvStride = cvStride;
+	r.width = width;
+	r.p = p;
+	r.q = q;
+	// two planes that meet in the ray
+	vec3 d = normalize(dir);
+	vec3 axis = fabsf(d.x) < fabsf(d.y) ? (fabsf(d.x) < fabsf(d.z) ? vec3(1,0,0) : vec3(0,0,1)) :
+		(fabsf(d.y) < fabsf(d.z) ? vec3(0,1,0) : vec3(0,0,1));
+	vec3 n1 = normalize(cross(d, axis));
+	vec3 n2 = cross(d, n1);
+	r.plane1 = vec4(n1, -dot(n1, orig));
+	r.plane2 = vec4(n2, -dot(n2, orig));
+	r.depth = vec4(dir, -dot(dir, orig))/dot(dir, dir);
+	r.depthScale = length(dir);
+	r.t = t;
+	r.hit = false;
+
+	vec4 h[(MAX_DEGREE+1)*(MAX_DEGREE+1)];
+	Box box;
+	box.Init();
+	for(int j = 0; j <= q; j++)
+		for(int i = 0; i <= p; i++) {
+			vec4 cv = *CV(cvs, cvStride, j*width + i);
+			h[j*(p+1) + i] = vec4(dot(r.plane1, cv), dot(r.plane2, cv), dot(r.depth, cv), cv.w);
+			box.ContainPoint(vec3(cv)/cv.w);
+		}
+	// hits have to be this close relative to the patch
+	r.leafSize = max(length(box.sup - box.inf)*1e-4f, 1e-6f);
+	r.newtonSize = r.leafSize*100.0f;
+	ClipPatch(r, h, 0.0f, 1.0f, 0.0f, 1.0f, 0);
+	if(r.hit) {
+		t = r.t;
+		s = r.s;
+		u = r.u;
+	}
+	return r.hit;
+}
+
+// Boxes of the CVs of patches [su0,su1) x [sv0,sv1), halved along the longer side
+int
+BezierForm::BuildBounds(int su0, int sv0, int su1, int sv1)
+{
+	Bound b;
+	b.su0 = su0;
+	b.sv0 = sv0;
+	b.su1 = su1;
+	b.sv1 = sv1;
+	b.box.Init();
+	int n = bounds.size();
+	bounds.push_back(b);
+	if(su1-su0 == 1 && sv1-sv0 == 1) {
+		b.child[0] = b.child[1] = -1;
+		const vec4 *cvs = Patch(su0, sv0);
+		for(int j = 0; j <= degreeV; j++)
+			for(int i = 0; i <= degreeU; i++) {
+				vec4 cv = cvs[j*Width() + i];
+				b.box.ContainPoint(vec3(cv)/cv.w);
+			}
+	} else {
+		if(su1-su0 >= sv1-sv0) {
+			int mid = (su0+su1)/2;
+			b.child[0] = BuildBounds(su0, sv0, mid, sv1);
+			b.child[1] = BuildBounds(mid, sv0, su1, sv1);
+		} else {
+			int mid = (sv0+sv1)/2;
+			b.child[0] = BuildBounds(su0, sv0, su1, mid);
+			b.child[1] = BuildBounds(su0, mid, su1, sv1);
+		}
+		for(int i = 0; i < 2; i++) {
+			b.box.ContainPoint(bounds[b.child[i]].box.inf);
+			b.box.ContainPoint(bounds[b.child[i]].box.sup);
+		}
+	}
+	bounds[n] = b;
+	return n;
+}
+
+// Closest hit with the surface for t in [0,t), (u,v) in the original parameters
+bool
+BezierForm::IntersectRay(vec3 orig, vec3 dir, float &t, float &u, float &v) const
+{
+	if(bounds.empty())
+		return false;
+	vec3 invDir = vec3(1.0f)/dir;
+	bool hit = false;
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while(sp > 0) {
+		const Bound &b = bounds[stack[--sp]];
+		if(!RayHitsBox(b.box, orig, invDir, t))
+			continue;
+		if(b.child[0] >= 0) {
+			stack[sp++] = b.child[1];
+			stack[sp++] = b.child[0];
+			continue;
+		}
+		float s, w;
+		if(IntersectRayPatch(Patch(b.su0, b.sv0), sizeof(vec4), Width(), degreeU, degreeV,
+		   orig, dir, t, s, w)) {
+			u = breaksU[b.su0] + s*(breaksU[b.su0+1] - breaksU[b.su0]);
+			v = breaksV[b.sv0] + w*(breaksV[b.sv0+1] - breaksV[b.sv0]);
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+static float
+BoxDistance2(const Box &box, vec3 p)
+{
+	vec3 d = glm::max(glm::max(box.inf - p, p - box.sup), vec3(0.0f));
+	return dot(d, d);
+}
+
+// Closest point of a rational Bezier patch (curve segment if q is 0) to pt.
+// Starts from the closest of a few samples and does Gauss-Newton steps,
+// halved while they do not get closer. Returns the squared distance.
+static float
+ProjectPatch(const vec4 *cvs, u32 cvStride, int width, int p, int q, vec3 pt, float &s, float &u, vec3 &closest)
+{
+	vec3 P, Ps, Pu;
+	float best = FLT_MAX;
+	int n = p+1;
+	int m = q > 0 ? q+1 : 1;
+	for(int j = 0; j < m; j++)
+		for(int i = 0; i < n; i++) {
+			float si = (i+0.5f)/n;
+			float uj = q > 0 ? (j+0.5f)/m : 0.0f;
+			EvalPatch(cvs, cvStride, width, p, q, si, uj, &P, &Ps, &Pu);
+			float d = distance2(P, pt);
+			if(d < best) {
+				best = d;
+				s = si;
+				u = uj;
+				closest = P;
+			}
+		}
+	for(int it = 0; it < 64; it++) {
+		EvalPatch(cvs, cvStride, width, p, q, s, u, &P, &Ps, &Pu);
+		vec3 r = P - pt;
+		float a = dot(Ps, Ps);
+		float b = dot(Ps, Pu);
+		float c = dot(Pu, Pu);
+		float gs = dot(Ps, r);
+		float gu = dot(Pu, r);
+		float ds, du;
+		if(q == 0) {
+			if(a == 0.0f)
+				break;
+			ds = -gs/a;
+			du = 0.0f;
+		} else {
+			float det = a*c - b*b;
+			if(det == 0.0f)
+				break;
+			ds = -(c*gs - b*gu)/det;
+			du = -(a*gu - b*gs)/det;
+		}
+		float step = 1.0f;
+		bool better = false;
+		for(int k = 0; k < 8 && !better; k++, step *= 0.5f) {
+			float ns = clamp(s + step*ds, 0.0f, 1.0f);
+			float nu = clamp(u + step*du, 0.0f, 1.0f);
+			EvalPatch(cvs, cvStride, width, p, q, ns, nu, &P, &Ps, &Pu);
+			float d = distance2(P, pt);
+			if(d < best) {
+				better = fabsf(ns-s) + fabsf(nu-u) > 1e-6f;
+				best = d;
+				s = ns;
+				u = nu;
+				closest = P;
+			}
+		}
+		if(!better)
+			break;
+	}
+	return best;
+}
+
+// Closest point of the curve or surface to pt, the hierarchy is walked
+// nearest box first and boxes farther than the best point so far skipped.
+// dist2 is an upper bound on entry, the squared distance on return.
+// false if nothing is closer than that.
+bool
+BezierForm::Project(vec3 pt, float &dist2, float &u, float &v, vec3 &closest) const
+{
+	if(bounds.empty())
+		return false;
+	bool found = false;
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	while(sp > 0) {
+		const Bound &b = bounds[stack[--sp]];
+		if(BoxDistance2(b.box, pt) >= dist2)
+			continue;
+		if(b.child[0] >= 0) {
+			int near = BoxDistance2(bounds[b.child[0]].box, pt) <= BoxDistance2(bounds[b.child[1]].box, pt) ? 0 : 1;
+			stack[sp++] = b.child[1-near];
+			stack[sp++] = b.child[near];
+			continue;
+		}
+		float s, w;
+		vec3 p;
+		float d = ProjectPatch(Patch(b.su0, b.sv0), sizeof(vec4), Width(), degreeU, degreeV, pt, s, w, p);
+		if(d < dist2) {
+			dist2 = d;
+			u = breaksU[b.su0] + s*(breaksU[b.su0+1] - breaksU[b.su0]);
+			v = breaksV[b.sv0] + w*(breaksV[b.sv0+1] - breaksV[b.sv0]);
+			closest = p;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Parameters in [0,1] of points to interpolate, spaced by chord length
+// or by its square root (centripetal, better for sharp turns).
+// Summed in double so 100k points still come out increasing.
+void
+InterpParams(const vec4 *pts, u32 stride, int n, bool centripetal, float *params)
+{
+	std::vector<double> d(n, 0.0);
+	for(int i = 1; i < n; i++) {
+		vec4 a = *CV(pts, stride, i-1);
+		vec4 b = *CV(pts, stride, i);
+		double l = glm::length(vec3(b)/b.w - vec3(a)/a.w);
+		d[i] = d[i-1] + (centripetal ? sqrt(l) : l);
+	}
+	for(int i = 0; i < n; i++)
+		params[i] = d[n-1] > 0.0 ? d[i]/d[n-1] : n > 1 ? (float)i/(n-1) : 0.0f;
+	params[n-1] = 1.0f;
+}
+
+// Clamped knots for n CVs with each interior knot the average
+// of degree parameters, so every span has a parameter in it
+void
+AveragedKnots(const float *params, int n, int degree, float *knots)
+{
+	int p = degree;
+	for(int i = 0; i <= p; i++) {
+		knots[i] = 0.0f;
+		knots[n+i] = 1.0f;
+	}
+	for(int j = 1; j < n-p; j++) {
+		double sum = 0.0;
+		for(int i = j; i < j+p; i++)
+			sum += params[i];
+		knots[j+p] = sum/p;
+	}
+}
+
+// Solve sum_j N_j(params[i]) x_j = rhs_i for the CVs x of an interpolating
+// curve, params increasing. The matrix has bandwidth degree and is totally
+// positive, so elimination in the band without pivoting is stable and O(n).
+bool
+SolveCollocation(const float *params, int n, int degree, const float *knots,
+	const vec4 *rhs, u32 rhsStride, vec4 *x, u32 xStride)
+{
+	int p = degree;
+	int w = 2*p+1;
+	std::vector<float> band(n*w, 0.0f);
+	#define A(i, j) band[(i)*w + (j)-(i)+p]
+	#define X(i) (*OUTCV(x, xStride, i))
+	int span = p;
+	for(int i = 0; i < n; i++) {
+		float N[MAX_DEGREE+1];
+		// like FindSpan but walking along
+		while(span < n-1 && params[i] >= knots[span+1])
+			span++;
+		EvalBasis(params[i], span, p, knots, N);
+		for(int k = 0; k <= p; k++) {
+			int j = span-p+k;
+			if(abs(j-i) > p) {
+				if(N[k] != 0.0f)
+					return false;
+				continue;
+			}
+			A(i, j) = N[k];
+		}
+		X(i) = *CV(rhs, rhsStride, i);
+	}
+	for(int k = 0; k < n; k++) {
+		float pivot = A(k, k);
+		if(pivot == 0.0f)
+			return false;
+		int last = std::min(k+p, n-1);
+		for(int i = k+1; i <= last; i++) {
+			float f = A(i, k)/pivot;
+			if(f == 0.0f)
+				continue;
+			for(int j = k; j <= last; j++)
+				A(i, j) -= f*A(k, j);
+			X(i) -= f*X(k);
+		}
+	}
+	for(int i = n-1; i >= 0; i--) {
+		vec4 s = X(i);
+		for(int j = i+1; j <= std::min(i+p, n-1); j++)
+			s -= A(i, j)*X(j);
+		X(i) = s/A(i, i);
+	}
+	#undef A
+	#undef X
+	return true;
+}
@@ -11,7 +11,15 @@
 #include <rw.h>
 #include <src/rwgta.h>
 
-Polyset::Polyset(void) : numTriangles(0), numEdges(0), maxVertsEdges(0), shadedMesh(nil), wireMesh(nil), cvMesh(nil) {}
+Polyset::Polyset(void) : numTriangles(0), numEdges(0), maxVertsEdges(0), shadedMesh(nil), wireMesh(nil), cvMesh(nil), lodLevel(-1) {}
+
+// split shaded meshes with too many vertices for 16 bit indices
+bool chunkLargeMeshes = false;
+
+// lods[i] are drawn when the bounding sphere is less than
+// polysetLodRadius/2^i pixels in radius on screen,
+// ReadObjFile fills them from pre-simplified files
+float polysetLodRadius = 256.0f;
 
 void
 Polyset::UpdateCVs(void)
@@ -56,11 +64,11 @@ Polyset::UpdateCVs(void)
 	memcpy(verts, vertices_, sizeof(vertices_));
 	memcpy(inds, indices, sizeof(indices));
 
-	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices_), verts, nelem(indices), inds, sizeof(Vertex), instData, vertices.size());
+	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices_), verts, nelem(indices), inds, &iconVertexLayout, instData, vertices.size());
 }
 
-static int
-FindEdge(int i0, int i1, u16 *indices, int numIndices)
+template <typename T> static int
+FindEdge(int i0, int i1, T *indices, int numIndices)
 {
 	for(int i = 0; i < numIndices; i+=2)
 		if(indices[i] == i0 && indices[i+1] == i1)
@@ -80,16 +88,52 @@ FindIndex(PolyIndex &idx, PolyIndex *indices, int numIndices)
 }
 			
 
+// Unique edges, unselected ones first and the selected ones after them.
+// Selected edges are collected from the end of the size indices,
+// returns the number of indices and the unselected ones in *numUnsel
+template <typename T> int
+Polyset::WireIndices(T *indices, int size, int *numUnsel)
+{
+	int numIndices = 0;
+	int idx = 0;
+	int idxu = size;
+	for(u32 i = 0; i < polygons.size(); i++) {
+		Polygon &p = polygons[i];
+		for(u32 j = 0; j < p.indices.size(); j++) {
+			int t;
+			int i0 = uniqueVertices[p.indices[j]].pos;
+			int i1 = uniqueVertices[p.indices[(j+1) % p.indices.size()]].pos;
+			if(i0 > i1)
+				t = i0, i0 = i1, i1 = t;
+			if(FindEdge(i0, i1, indices, idx) < 0 &&
+			   FindEdge(i0, i1, indices+idxu, size-idxu) < 0) {
+				if(vertices[i0].selected || vertices[i1].selected) {
+					indices[--idxu] = i1;
+					indices[--idxu] = i0;
+				} else {
+					indices[idx++] = i0;
+					indices[idx++] = i1;
+				}
+				numIndices += 2;
+			}
+			assert(numIndices <= size);
+		}
+	}
+	memmove(&indices[idx], &indices[idxu], (size-idxu)*sizeof(T));
+	*numUnsel = idx;
+	return numIndices;
+}
+
 void
 Polyset::UpdateWire(void)
 {
-	Vertex *verts;
-	u16 *indices;
+	LineVertex *verts;
+	u32 *indices;
 	if(dirty & DIRTY_POS || wireMesh == nil) {
 		if(wireMesh)
-			verts = (Vertex*)wireMesh->vertices;
+			verts = (LineVertex*)wireMesh->vertices;
 		else
-			verts = new Vertex[vertices.size()];
+			verts = new LineVertex[vertices.size()];
 
 		for(u32 i = 0; i < vertices.size(); i++) {
 			verts[i].pos[0] = vertices[i].pos.x;
@@ -105,48 +149,31 @@ Polyset::UpdateWire(void)
 	}
 
 	int numIndices = 0;
+	int idx = 0;
 	if(dirty & DIRTY_SEL || wireMesh == nil) {
-		if(wireMesh)
-			indices = wireMesh->indices;
+		// once the edges are known the selected ones are moved in place
+		if(wireMesh == nil) {
+			indices = new u32[maxVertsEdges*2];
+			numIndices = WireIndices(indices, maxVertsEdges*2, &idx);
+		} else if(wireMesh->wideIndices)
+			numIndices = WireIndices(wireMesh->indices32, wireMesh->numIndices, &idx);
 		else
-			indices = new u16[maxVertsEdges*2];
-		int idx = 0;
-		int idxu = maxVertsEdges*2;
-		for(u32 i = 0; i < polygons.size(); i++) {
-			Polygon &p = polygons[i];
-			for(u32 j = 0; j < p.indices.size(); j++) {
-				int t;
-				int i0 = uniqueVertices[p.indices[j]].pos;
-				int i1 = uniqueVertices[p.indices[(j+1) % p.indices.size()]].pos;
-				if(i0 > i1)
-					t = i0, i0 = i1, i1 = t;
-				if(FindEdge(i0, i1, indices, idx) < 0 &&
-				   FindEdge(i0, i1, indices+idxu, maxVertsEdges*2-idxu) < 0) {
-					if(vertices[i0].selected || vertices[i1].selected) {
-						indices[--idxu] = i1;
-						indices[--idxu] = i0;
-					} else {
-						indices[idx++] = i0;
-						indices[idx++] = i1;
-					}
-					numIndices += 2;
-				}
-				assert(numIndices <= maxVertsEdges*2);
-			}
-		}
-		memmove(&indices[idx], &indices[idxu], (maxVertsEdges*2-idxu)*sizeof(u16));
+			numIndices = WireIndices(wireMesh->indices, wireMesh->numIndices, &idx);
 		if(wireMesh) {
+			assert(numIndices == (int)wireMesh->numIndices);
 			wireMesh->submeshes[0].numIndices = idx;
-			wireMesh->submeshes[1].numIndices = wireMesh->numIndices - idx;
+			wireMesh->submeshes[1].numIndices = numIndices - idx;
 			wireMesh->UpdateIndices();
 		}
 	}
 
 	if(wireMesh == nil) {
-		wireMesh = CreateMesh(GL_LINES, vertices.size(), verts, numIndices, indices, sizeof(Vertex));
+		numEdges = numIndices/2;
+		wireMesh = CreateMesh(GL_LINES, vertices.size(), verts, numIndices, indices, &lineVertexLayout);
 		wireMesh->submeshes[0].matID = MATID_WIRE;
+		wireMesh->submeshes[0].numIndices = idx;
 		Mesh::Submesh sm;
-		sm.numIndices = 0;
+		sm.numIndices = numIndices - idx;
 		sm.matID = MATID_WIRE_ACTIVE;
 		wireMesh->submeshes.push_back(sm);
 	}
@@ -158,34 +185,31 @@ Polyset::UpdateShaded(void)
 	if(!(dirty & DIRTY_POS))
 		return;
 
-	Vertex *verts;
-	if(shadedMesh)
-		verts = (Vertex*)shadedMesh->vertices;
-	else
-		verts = new Vertex[uniqueVertices.size()];
+	PackedVertex *verts;
+	u32 numVerts;
+	if(shadedMesh) {
+		verts = (PackedVertex*)shadedMesh->vertices;
+		numVerts = shadedMesh->numVertices;
+	} else {
+		verts = new PackedVertex[uniqueVertices.size()];
+		numVerts = uniqueVertices.size();
+	}
 
-	for(u32 i = 0; i < uniqueVertices.size(); i++) {
-		PolyIndex idx = uniqueVertices[i];
-		Vertex *vx = &verts[i];
+	for(u32 i = 0; i < numVerts; i++) {
+		PolyIndex idx = uniqueVertices[shadedMap.empty() ? i : shadedMap[i]];
+		PackedVertex *vx = &verts[i];
 		vec3 pos = vertices[idx.pos].pos;
 		vx->pos[0] = pos.x;
 		vx->pos[1] = pos.y;
 		vx->pos[2] = pos.z;
-		if(idx.norm >= 0) {
-			vec3 n = normals[idx.norm];
-			vx->normal[0] = n.x;
-			vx->normal[1] = n.y;
-			vx->normal[2] = n.z;
-		}
+		vx->normal = idx.norm >= 0 ? PackNormal(normals[idx.norm]) : 0;
 		vx->color[0] = 255;
 		vx->color[1] = 255;
 		vx->color[2] = 255;
 		vx->color[3] = 255;
-		if(idx.tex >= 0) {
-			vec2 uv = uvs[idx.tex];
-			vx->uv[0] = uv.x;
-			vx->uv[1] = uv.y;
-		}
+		vec2 uv = idx.tex >= 0 ? uvs[idx.tex] : vec2(0.0f);
+		vx->uv[0] = PackHalf(uv.x);
+		vx->uv[1] = PackHalf(uv.y);
 	}
 	if(shadedMesh) {
 		shadedMesh->UpdateMesh();
@@ -194,7 +218,7 @@ Polyset::UpdateShaded(void)
 
 	std::vector<Mesh::Submesh> submeshes;
 	Mesh::Submesh sm;
-	u16 *indices = new u16[numTriangles*3];
+	u32 *indices = new u32[numTriangles*3];
 	int idx = 0;
 	sm.matID = -1;
 	for(u32 i = 0; i < polygons.size(); i++) {
@@ -216,24 +240,80 @@ Polyset::UpdateShaded(void)
 	if(sm.matID >= 0)
 		submeshes.push_back(sm);
 
-	shadedMesh = CreateMesh(GL_TRIANGLES, uniqueVertices.size(), verts, numTriangles*3, indices, sizeof(Vertex));
-	shadedMesh->submeshes = submeshes;
+	if(chunkLargeMeshes && uniqueVertices.size() > 0x10000) {
+		shadedMesh = CreateChunkedMesh(GL_TRIANGLES, uniqueVertices.size(), verts, numTriangles*3, indices, &packedVertexLayout,
+			submeshes, shadedMap);
+		delete[] indices;
+		delete[] verts;
+	} else {
+		shadedMesh = CreateMesh(GL_TRIANGLES, uniqueVertices.size(), verts, numTriangles*3, indices, &packedVertexLayout);
+		shadedMesh->submeshes = submeshes;
+	}
 }
 
 void
 Polyset::Update(void)
 {
+	UpdateBound();
 	UpdateCVs();
 	UpdateWire();
 	UpdateShaded();
 	dirty = 0;
 }
 
+void
+Polyset::UpdateBound(void)
+{
+	if(!(dirty & DIRTY_POS))
+		return;
+	boundBox.Init();
+	for(u32 i = 0; i < vertices.size(); i++)
+		boundBox.ContainPoint(vec3(vertices[i].pos));
+	boundSphere.FromBox(boundBox);
+}
+
+bool
+Polyset::IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist)
+{
+	// might not have been drawn yet
+	if(!BoundOnRay(matrix, orig, dir))
+		return false;
+	Update();
+	return shadedMesh->IntersectRay(matrix, orig, dir, dist);
+}
+
+bool
+Polyset::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
+{
+	if(!BoundInFrustum(matrix, planes))
+		return false;
+	Update();
+	return shadedMesh->IntersectFrustum(matrix, planes);
+}
+
+// This or the simplified version for the current view
+Polyset*
+Polyset::LevelToDraw(void)
+{
+	if(lods.empty() || polysetLodRadius <= 0.0f)
+		return this;
+	// level 0 when one pixel is radius/polysetLodRadius
+	lodLevel = SelectLevel(DetailLevel(1.0f, node ? node->globalMatrix : mat4(1.0f), boundSphere,
+		boundSphere.radius/polysetLodRadius), lodLevel);
+	int l = min(lodLevel, (int)lods.size());
+	return l == 0 ? this : lods[l-1];
+}
+
 void
 Polyset::DrawWire(bool active)
 {
 	Update();
 
+	Polyset *ps = active ? this : LevelToDraw();
+	if(ps != this) {
+		ps->DrawWire(false);
+		return;
+	}
 	if(active) {
 		ForceColor(activeColor);
 		wireMesh->DrawRaw();
@@ -246,6 +326,11 @@ Polyset::DrawShaded(void)
 {
 	Update();
 
+	Polyset *ps = LevelToDraw();
+	if(ps != this) {
+		ps->DrawShaded();
+		return;
+	}
 	shadedMesh->DrawShaded();
 }
 
@@ -383,6 +468,8 @@ ReadObjFile(FILE *f)
 	return ps;
 }
 
+// Simplified versions are read from name_lod1.obj, name_lod2.obj...
+// next to name.obj if they exist.
 Polyset*
 ReadObjFile(const char *path)
 {
@@ -391,6 +478,19 @@ ReadObjFile(const char *path)
 		return nil;
 	Polyset *ps = ReadObjFile(f);
 	fclose(f);
+
+	char lodPath[1024];
+	const char *ext = strrchr(path, '.');
+	if(ext == nil || strchr(ext, '/'))
+		ext = path + strlen(path);
+	for(int i = 1; i < MAX_LOD_LEVELS; i++) {
+		snprintf(lodPath, sizeof(lodPath), "%.*s_lod%d%s", (int)(ext - path), path, i, ext);
+		f = fopen(lodPath, "r");
+		if(f == nil)
+			break;
+		ps->lods.push_back(ReadObjFile(f));
+		fclose(f);
+	}
 	return ps;
 }
 
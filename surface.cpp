@@ -5,17 +5,31 @@
 
 #include <stdio.h>
 #include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <iterator>
 
 
-float evalBasis(float t, int i, int d, float *knots);
+// Evaluate the tessellation grid in a compute shader, the CPU copy
+// of the vertices is then only read back for picking
+bool computeTessellation = false;
 
-Surface::Surface(void) : degreeU(0), degreeV(0), numU(0), numV(0), surfaceMesh(nil), curveMesh(nil), hullMesh(nil), cvMesh(nil), matID(MATID_DEFAULT) {}
+Surface::Surface(void) : degreeU(0), degreeV(0), numU(0), numV(0), surfaceMesh(nil), curveMesh(nil), hullMesh(nil), cvMesh(nil), matID(MATID_DEFAULT),
+	editU0(1<<30), editV0(1<<30), editU1(-1), editV1(-1), cvBuffer(0), paramBuffer(0), staleVertices(false),
+	lodLevel(-1), viewLevel(-1), drawLevel(-1), previewLevels(0), previewFrame(0), version(0), tessJob(nil), jobDirty(0) {}
 
 Surface::~Surface(void)
 {
+	if(tessJob)
+		AbandonJob(tessJob);
 	delete hullMesh;
 	delete surfaceMesh;
 	delete cvMesh;
+	for(int i = 0; i < MAX_LOD_LEVELS; i++) {
+		delete lodCache[i].surfaceMesh;
+		delete lodCache[i].curveMesh;
+	}
+	FreeBuffers();
 }
 
 
@@ -24,11 +38,12 @@ Surface::DrawWire(bool active)
 {
 	Update();
 
+	Mesh *mesh = drawLevel >= 0 ? lodCache[drawLevel].curveMesh : curveMesh;
 	if(active) {
 		ForceColor(activeColor);
-		curveMesh->DrawRaw();
+		mesh->DrawRaw();
 	} else
-		curveMesh->DrawShaded();
+		mesh->DrawShaded();
 }
 
 void
@@ -49,24 +64,114 @@ void
 Surface::DrawShaded(void)
 {
 	Update();
-	surfaceMesh->submeshes[0].matID = matID;
-	surfaceMesh->DrawShaded();
+	Mesh *mesh = drawLevel >= 0 ? lodCache[drawLevel].surfaceMesh : surfaceMesh;
+	mesh->submeshes[0].matID = matID;
+	mesh->DrawShaded();
+}
+
+bool
+Surface::IntersectRay(const mat4 &matrix, vec3 orig, vec3 dir, float &dist)
+{
+	float u, v;
+	return IntersectRayUV(matrix, orig, dir, dist, u, v);
+}
+
+// Hit with the surface itself, not its tessellation,
+// so it does not have to be updated
+bool
+Surface::IntersectRayUV(const mat4 &matrix, vec3 orig, vec3 dir, float &dist, float &u, float &v)
+{
+	if(!BoundOnRay(matrix, orig, dir))
+		return false;
+	mat4 inv = glm::inverse(matrix);
+	// only hits on the pick segment, dir reaches the far plane
+	float t = 1.0f;
+	if(!GetBezierForm().IntersectRay(vec3(inv * vec4(orig, 1.0f)), glm::mat3(inv) * dir, t, u, v))
+		return false;
+	dist = t;
+	return true;
+}
+
+bool
+Surface::IntersectFrustum(const mat4 &matrix, const vec4 *planes)
+{
+	if(!BoundInFrustum(matrix, planes))
+		return false;
+	Update();
+	if(drawLevel >= 0)
+		return lodCache[drawLevel].surfaceMesh->IntersectFrustum(matrix, planes);
+	SyncVertices();
+	return surfaceMesh->IntersectFrustum(matrix, planes);
 }
 
 void
 Surface::Update(void)
 {
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS)) {
+		bezier.valid = false;
+		version++;
+		TrimCache();
+	}
+	UpdateTessellation();
 	UpdateCVs();
 	UpdateHull();
 	UpdateSurface();
 	UpdateCurve();
+	if(surfaceMesh) {
+		// the tessellation is inside the CV hull too
+		surfaceMesh->boundBox = curveMesh->boundBox = boundBox;
+		surfaceMesh->boundSphere = curveMesh->boundSphere = boundSphere;
+		// the new level is there, the one drawn meanwhile can go
+		if(drawLevel >= 0) {
+			drawLevel = -1;
+			TrimCache();
+		}
+	}
 	dirty = 0;
+	editU0 = editV0 = 1<<30;
+	editU1 = editV1 = -1;
+}
+
+// Only the spans around moved CVs have to be updated
+void
+Surface::CVMoved(ControlVertex *cv)
+{
+	int i = (ControlVertex*)cv - &CVs[0];
+	int iu = i % numU;
+	int iv = i / numU;
+	editU0 = min(editU0, iu);
+	editU1 = max(editU1, iu);
+	editV0 = min(editV0, iv);
+	editV1 = max(editV1, iv);
+	dirty |= DIRTY_CVS;
+}
+
+// Samples [u0,u1) x [v0,v1) of tu x tv that moved CVs have influence on.
+// false if everything has to be updated.
+bool
+Surface::EditedSamples(const BasisTable &tu, const BasisTable &tv, int *u0, int *u1, int *v0, int *v1)
+{
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_TESS) || !(dirty & DIRTY_CVS))
+		return false;
+	tu.FindSamples(knotsU[editU0], knotsU[editU1+degreeU+1], u0, u1);
+	tv.FindSamples(knotsV[editV0], knotsV[editV1+degreeV+1], v0, v1);
+	return true;
 }
 
 void
 Surface::UpdateCVs(void)
 {
-	if(!dirty)
+	if(cvMesh && !(dirty & (DIRTY_SEL|DIRTY_POS)) && dirty & DIRTY_CVS) {
+		for(int iv = editV0; iv <= editV1; iv++) {
+			for(int iu = editU0; iu <= editU1; iu++) {
+				int i = iv*numU + iu;
+				cvMesh->inst[i].pos_sel = vec4(vec3(CVs[i].pos), CVs[i].selected);
+			}
+			cvMesh->UpdateInstanceData(iv*numU + editU0, editU1-editU0+1);
+		}
+		return;
+	}
+	if(!(dirty & (DIRTY_SEL|DIRTY_POS)))
 		return;
 //	assert(knots.size() == CVs.size() + degree + 1);
 
@@ -123,7 +228,7 @@ Surface::UpdateCVs(void)
 	memcpy(verts, vertices, sizeof(vertices));
 	memcpy(inds, indices, sizeof(indices));
 
-	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, sizeof(Vertex), instData, CVs.size());
+	cvMesh = CreateInstanceMesh(GL_TRIANGLES, nelem(vertices), verts, nelem(indices), inds, &iconVertexLayout, instData, CVs.size());
 }
 
 void
@@ -131,13 +236,25 @@ Surface::UpdateHull(void)
 {
 	int N = CVs.size();
 	int numIndices = 2*(numU-1)*numV + 2*(numV-1)*numU;
-	Vertex *verts;
+	LineVertex *verts;
 	u16 *indices;
+	if(hullMesh && !(dirty & DIRTY_POS) && dirty & DIRTY_CVS) {
+		verts = (LineVertex*)hullMesh->vertices;
+		for(int iv = editV0; iv <= editV1; iv++) {
+			for(int iu = editU0; iu <= editU1; iu++) {
+				int i = iv*numU + iu;
+				verts[i].pos[0] = CVs[i].pos.x;
+				verts[i].pos[1] = CVs[i].pos.y;
+				verts[i].pos[2] = CVs[i].pos.z;
+			}
+			hullMesh->UpdateMesh(iv*numU + editU0, editU1-editU0+1);
+		}
+	}
 	if(dirty & DIRTY_POS || hullMesh == nil) {
 		if(hullMesh)
-			verts = (Vertex*)hullMesh->vertices;
+			verts = (LineVertex*)hullMesh->vertices;
 		else
-			verts = new Vertex[N];
+			verts = new LineVertex[N];
 
 		for(int i = 0; i < N; i++) {
 			verts[i].pos[0] = CVs[i].pos.x;
@@ -192,7 +309,7 @@ Surface::UpdateHull(void)
 	}
 
 	if(hullMesh == nil) {
-		hullMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, sizeof(Vertex));
+		hullMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, &lineVertexLayout);
 		hullMesh->submeshes[0].matID = MATID_HULL;
 		Mesh::Submesh sm;
 		sm.numIndices = 0;
@@ -201,66 +318,251 @@ Surface::UpdateHull(void)
 	}
 }
 
+float surfaceTolerance = 0.002f;
+// Surfaces edited during a drag are tessellated this many levels
+// coarser and refined one level per frame once it stops
+int dragPreviewLevels = 2;
+
+static vec3
+Point(const ControlVertex &cv)
+{
+	return vec3(cv.pos)/cv.pos.w;
+}
+
+// Bound on |C''|/8 of the isoparms over knot spans [first,last] in u
+// (or v if transposed) from second and mixed differences of the CVs
+// in rows [row0,row1]. Only ever raises curv.
+// Weights are ignored apart from dehomogenizing the CVs.
+static void
+SpanCurvature(const ControlVertex *cvs, int p, int q, int n, int m, bool transposed,
+	int first, int last, int row0, int row1, std::vector<float> &curv)
+{
+	#define CVAT(i, j) Point(transposed ? cvs[(i)*m + (j)] : cvs[(j)*n + (i)])
+	for(int span = max(first, p); span <= min(last, n-1); span++) {
+		float duu = 0.0f;
+		float duv = 0.0f;
+		for(int j = max(row0, 0); j <= min(row1, m-1); j++)
+			for(int i = span-p; i < span; i++) {
+				vec3 d1 = CVAT(i+1, j) - CVAT(i, j);
+				if(i+2 <= span)
+					duu = max(duu, length(CVAT(i+2, j) - CVAT(i+1, j) - d1));
+				if(j+1 < m)
+					duv = max(duv, length(CVAT(i+1, j+1) - CVAT(i, j+1) - d1));
+			}
+		curv[span] = max(curv[span], (p*(p-1)*duu + p*q*duv)/8.0f);
+	}
+	#undef CVAT
+}
+
+// Samples of each knot span, always including the knots
+static void
+SpanSamples(const std::vector<float> &curv, const float *knots, int p, int n, float tol, std::vector<float> &samples)
+{
+	samples.clear();
+	for(int span = p; span < n; span++) {
+		float u0 = knots[span];
+		float u1 = knots[span+1];
+		if(u0 == u1)
+			continue;
+		int segs = SegmentsForTolerance(curv[span], tol);
+		for(int i = 0; i < segs; i++)
+			samples.push_back(u0 + (u1-u0)*i/segs);
+	}
+	samples.push_back(knots[n]);
+}
+
+// The surface lies in the convex hull of its CVs, so their box bounds it.
+// Edits can only make it grow until the next full update,
+// that way only the moved CVs have to be looked at.
 void
-Surface::UpdateSurface(void)
+Surface::UpdateBound(void)
 {
-	if(!(dirty & DIRTY_POS))
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS)) {
+		boundBox.Init();
+		for(u32 i = 0; i < CVs.size(); i++)
+			boundBox.ContainPoint(Point(CVs[i]));
+		boundSphere.FromBox(boundBox);
+	} else if(dirty & DIRTY_CVS) {
+		for(int iv = editV0; iv <= editV1; iv++)
+			for(int iu = editU0; iu <= editU1; iu++)
+				boundBox.ContainPoint(Point(CVs[iv*numU + iu]));
+		boundSphere.FromBox(boundBox);
+	}
+}
+
+// Keep the current tessellation in lodCache and use the one of level
+// if it was made from the current CVs and knots, otherwise it is redone.
+// A level without a mesh may be made on the worker,
+// the old one is drawn as drawLevel until then.
+void
+Surface::SwitchLevel(int level)
+{
+	if(level == lodLevel)
 		return;
+	int prevLevel = lodLevel;
+	bool drawable = surfaceMesh && !staleVertices;
+	// the drawn tessellation is behind the job
+	bool edited = dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS) || tessJob;
+	if(tessJob) {
+		AbandonJob(tessJob);
+		tessJob = nil;
+		jobDirty = 0;
+	}
+	if(lodLevel >= 0) {
+		SurfaceLevel &old = lodCache[lodLevel];
+		std::swap(old.tableU, tableU);
+		std::swap(old.tableV, tableV);
+		std::swap(old.isoGridU, isoGridU);
+		std::swap(old.isoGridV, isoGridV);
+		std::swap(old.surfaceMesh, surfaceMesh);
+		std::swap(old.curveMesh, curveMesh);
+		std::swap(old.staleVertices, staleVertices);
+		old.version = edited ? -1 : version;
+	}
+	SurfaceLevel &l = lodCache[level];
+	bool valid = l.surfaceMesh && l.version == version && !edited;
+	std::swap(l.tableU, tableU);
+	std::swap(l.tableV, tableV);
+	std::swap(l.isoGridU, isoGridU);
+	std::swap(l.isoGridV, isoGridV);
+	std::swap(l.surfaceMesh, surfaceMesh);
+	std::swap(l.curveMesh, curveMesh);
+	std::swap(l.staleVertices, staleVertices);
+	l.version = -1;
+	lodLevel = level;
+	if(level == drawLevel || valid)
+		drawLevel = -1;
+	else if(surfaceMesh == nil && drawLevel < 0 && drawable)
+		drawLevel = prevLevel;
+	TrimCache();
+	// the parameters in paramBuffer are those of the old level
+	FreeBuffers();
+	// selection may have changed since
+	dirty |= DIRTY_SEL;
+	if(!valid)
+		dirty |= DIRTY_TESS;
+}
 
-	int Nu = 5 * (numU - degreeU) + 1;
-	int Nv = 5 * (numV - degreeV) + 1;
-	Vertex *verts;
-	if(surfaceMesh)
-		verts = (Vertex*)surfaceMesh->vertices;
-	else
-		verts = new Vertex[Nu*Nv];
-
-	float minU = knotsU[0];
-	float maxU = knotsU[knotsU.size()-1];
-	float minV = knotsV[0];
-	float maxV = knotsV[knotsV.size()-1];
-	float eps = 0.0001f;
-	for(int iv = 0; iv < Nv; iv++) {
-		float v = (float)iv/(Nv-1) * (minV+maxV) - minV;
-		v = clamp(v, minV, maxV-eps);
-		for(int iu = 0; iu < Nu; iu++) {
-			float u = (float)iu/(Nu-1) * (minU+maxU) - minU;
-			u = clamp(u, minU, maxU-eps);
-			vec3 pos = Eval(u, v);
-			Vertex *vx = &verts[iv*Nu + iu];
-			vx->pos[0] = pos.x;
-			vx->pos[1] = pos.y;
-			vx->pos[2] = pos.z;
-
-			vec3 v1, v2;
-			if(iu == Nu-1)
-				v1 = pos - Eval(u-eps, v);
-			else
-				v1 = Eval(u+eps, v) - pos;
-			if(iv == Nv-1)
-				v2 = pos - Eval(u, v-eps);
-			else
-				v2 = Eval(u, v+eps) - pos;
-			vec3 n = normalize(cross(v1, v2));
-			if(length(n) == 0.0f)
-				n = vec3(0.0f, 0.0f, 1.0f);
-
-			vx->normal[0] = n.x;
-			vx->normal[1] = n.y;
-			vx->normal[2] = n.z;
-			vx->color[0] = 0;
-			vx->color[1] = 0;
-			vx->color[2] = 0;
-			vx->color[3] = 255;
-		}
+// Free the cached levels made before an edit
+// and all but the neighbours of lodLevel, except drawLevel
+void
+Surface::TrimCache(void)
+{
+	for(int i = 0; i < MAX_LOD_LEVELS; i++) {
+		SurfaceLevel &l = lodCache[i];
+		if(i == drawLevel ||
+		   (l.version == version && i >= lodLevel-1 && i <= lodLevel+1))
+			continue;
+		delete l.surfaceMesh;
+		delete l.curveMesh;
+		l = SurfaceLevel();
 	}
-	if(surfaceMesh) {
-		surfaceMesh->UpdateMesh();
-		return;
+}
+
+// Choose the tessellation grid from the curvature of each span
+// and the current tolerance, sets DIRTY_TESS if it changed.
+void
+Surface::UpdateTessellation(void)
+{
+	// like the bound the curvature only grows on local edits
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS) || spanCurvU.empty()) {
+		spanCurvU.assign(knotsU.size(), 0.0f);
+		spanCurvV.assign(knotsV.size(), 0.0f);
+		SpanCurvature(&CVs[0], degreeU, degreeV, numU, numV, false, 0, numU, 0, numV, spanCurvU);
+		SpanCurvature(&CVs[0], degreeV, degreeU, numV, numU, true, 0, numV, 0, numU, spanCurvV);
+	} else if(dirty & DIRTY_CVS) {
+		SpanCurvature(&CVs[0], degreeU, degreeV, numU, numV, false,
+			editU0, editU1+degreeU, editV0-1, editV1, spanCurvU);
+		SpanCurvature(&CVs[0], degreeV, degreeU, numV, numU, true,
+			editV0, editV1+degreeV, editU0-1, editU1, spanCurvV);
 	}
+	UpdateBound();
 
-	int numIndices = 3*2*(Nu-1)*(Nv-1);
-	u16 *indices = new u16[numIndices];
+	// Update runs for every pass, refine at most once a frame
+	// and only when the last level is done
+	if(dragging && dirty & (DIRTY_POS|DIRTY_CVS))
+		previewLevels = dragPreviewLevels;
+	else if(!dragging && previewLevels > 0 && previewFrame != frameNumber &&
+	        tessJob == nil && drawLevel < 0) {
+		previewLevels--;
+		previewFrame = frameNumber;
+	}
+
+	float tol = surfaceTolerance;
+	mat4 matrix = node ? node->globalMatrix : mat4(1.0f);
+	if(tol > 0.0f) {
+		if(pixelTolerance > 0.0f)
+			viewLevel = SelectLevel(DetailLevel(pixelTolerance, matrix, boundSphere, tol), viewLevel);
+		else
+			viewLevel = 0;
+		SwitchLevel(min(viewLevel + previewLevels, MAX_LOD_LEVELS-1));
+		tol = LevelTolerance(lodLevel, tol);
+	} else if(pixelTolerance > 0.0f)
+		tol = PixelsToObject(pixelTolerance, matrix, boundSphere);
+	// have to fit 16 bit indices
+	for(;;) {
+		SpanSamples(spanCurvU, &knotsU[0], degreeU, numU, tol, samplesU);
+		SpanSamples(spanCurvV, &knotsV[0], degreeV, numV, tol, samplesV);
+		if(samplesU.size()*samplesV.size() <= 0x10000)
+			break;
+		tol *= 2.0f;
+	}
+
+	// basis functions only depend on knots and sample parameters
+	if(dirty & DIRTY_KNOTS || samplesU != tableU.params) {
+		tableU.Build(&samplesU[0], samplesU.size(), degreeU, numU, &knotsU[0]);
+		dirty |= DIRTY_TESS;
+	}
+	if(dirty & DIRTY_KNOTS || samplesV != tableV.params) {
+		tableV.Build(&samplesV[0], samplesV.size(), degreeV, numV, &knotsV[0]);
+		dirty |= DIRTY_TESS;
+	}
+}
+
+static bool
+UseComputeTessellation(void)
+{
+	return computeTessellation && nurbsProg.program > 0;
+}
+
+// Grids of at least asyncTessSamples are evaluated on the worker thread
+// when the whole surface has to be redone, the old one is drawn meanwhile.
+bool asyncTessellation = true;
+int asyncTessSamples = 0x2000;
+
+// black, the surfaces have no texture coordinates
+static void
+SetColorUV(PackedVertex *vx)
+{
+	vx->color[0] = 0;
+	vx->color[1] = 0;
+	vx->color[2] = 0;
+	vx->color[3] = 255;
+	vx->uv[0] = 0;
+	vx->uv[1] = 0;
+}
+
+void
+SurfaceJob::Run(void)
+{
+	int Nu = tableU.numSamples;
+	int Nv = tableV.numSamples;
+	verts.resize(Nu*Nv);
+	// a few rows at a time so an abandoned job stops early
+	for(int v0 = 0; v0 < Nv; v0 += 16) {
+		if(Abandoned())
+			return;
+		EvalSurfaceGridRange(&CVs[0], sizeof(vec4), numU, tableU, tableV,
+			(vec3*)verts[0].pos, &verts[0].normal, sizeof(PackedVertex), Nu*sizeof(PackedVertex), scratch,
+			0, Nu, v0, min(v0+16, Nv));
+	}
+	for(int i = 0; i < Nu*Nv; i++)
+		SetColorUV(&verts[i]);
+}
+
+static void
+GridTriangles(u16 *indices, int Nu, int Nv)
+{
 	int idx = 0;
 	for(int iv = 0; iv < Nv-1; iv++) {
 		for(int iu = 0; iu < Nu-1; iu++) {
@@ -273,85 +575,360 @@ Surface::UpdateSurface(void)
 			indices[idx++] = (iv+1)*Nu + iu+1;
 		}
 	}
-	assert(numIndices == idx);
+}
+
+void
+Surface::StartJob(void)
+{
+	SurfaceJob *job = new SurfaceJob;
+	job->CVs.resize(numU*numV);
+	for(int i = 0; i < numU*numV; i++)
+		job->CVs[i] = CVs[i].pos;
+	job->numU = numU;
+	job->tableU = tableU;
+	job->tableV = tableV;
+	tessJob = job;
+	jobDirty = 0;
+	QueueJob(job);
+}
+
+// Use the grid of the finished job unless the tables changed since.
+// The curves are redone from it, edits made meanwhile need another job.
+// true if the grid is up to date.
+bool
+Surface::FinishJob(void)
+{
+	SurfaceJob *job = tessJob;
+	tessJob = nil;
+	dirty |= jobDirty;
+	jobDirty = 0;
+	bool current = !(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_TESS|DIRTY_CVS));
+	if(!(dirty & (DIRTY_KNOTS|DIRTY_TESS))) {
+		int Nu = tableU.numSamples;
+		int Nv = tableV.numSamples;
+		int numIndices = 3*2*(Nu-1)*(Nv-1);
+		PackedVertex *verts;
+		u16 *indices;
+		if(surfaceMesh) {
+			surfaceMesh->Resize(Nu*Nv, numIndices);
+			verts = (PackedVertex*)surfaceMesh->vertices;
+			indices = surfaceMesh->indices;
+		} else {
+			verts = new PackedVertex[Nu*Nv];
+			indices = new u16[numIndices];
+		}
+		memcpy(verts, &job->verts[0], Nu*Nv*sizeof(PackedVertex));
+		// only at degenerate points
+		for(int iv = 0; iv < Nv; iv++)
+			for(int iu = 0; iu < Nu; iu++) {
+				PackedVertex *vx = &verts[iv*Nu + iu];
+				if(vx->normal == 0)
+					vx->normal = PackNormal(EvalNormal(tableU.params[iu], tableV.params[iv]));
+			}
+		GridTriangles(indices, Nu, Nv);
+		if(surfaceMesh) {
+			surfaceMesh->submeshes[0].numIndices = numIndices;
+			surfaceMesh->UpdateMesh();
+			surfaceMesh->UpdateIndices();
+		} else
+			surfaceMesh = CreateMesh(GL_TRIANGLES, Nu*Nv, verts, numIndices, indices, &packedVertexLayout);
+		staleVertices = false;
+		FreeBuffers();
+	}
+	delete job;
+	dirty |= DIRTY_TESS;
+	return current;
+}
+
+void
+Surface::UpdateSurface(void)
+{
+	if(tessJob) {
+		if(!tessJob->Done()) {
+			jobDirty |= dirty;
+			return;
+		}
+		if(FinishJob())
+			return;
+	}
+	if(!(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_TESS|DIRTY_CVS)))
+		return;
+
+	int Nu = tableU.numSamples;
+	int Nv = tableV.numSamples;
+	int numIndices = 3*2*(Nu-1)*(Nv-1);
+
+	int u0 = 0;
+	int u1 = Nu;
+	int v0 = 0;
+	int v1 = Nv;
+	bool partial = surfaceMesh && EditedSamples(tableU, tableV, &u0, &u1, &v0, &v1);
+	// something has to be drawn meanwhile
+	bool shown = surfaceMesh || drawLevel >= 0;
+	if(shown && !partial && asyncTessellation && !UseComputeTessellation() &&
+	   Nu*Nv >= asyncTessSamples) {
+		StartJob();
+		return;
+	}
+
+	PackedVertex *verts;
+	u16 *indices;
+	if(surfaceMesh) {
+		if(dirty & DIRTY_TESS)
+			surfaceMesh->Resize(Nu*Nv, numIndices);
+		verts = (PackedVertex*)surfaceMesh->vertices;
+		indices = surfaceMesh->indices;
+	} else {
+		verts = new PackedVertex[Nu*Nv];
+		indices = new u16[numIndices];
+	}
+
+	if(surfaceMesh && UseComputeTessellation()) {
+		// straight into the vertex buffer
+		ComputeSurface(u0, u1, v0, v1);
+		staleVertices = true;
+		if(!(dirty & DIRTY_TESS))
+			return;
+	} else {
+		if(staleVertices && partial)
+			SyncVertices();
+		staleVertices = false;
+		FreeBuffers();
+
+		EvalSurfaceGridRange(&CVs[0].pos, sizeof(ControlVertex), numU, tableU, tableV,
+			(vec3*)verts[0].pos, &verts[0].normal, sizeof(PackedVertex), Nu*sizeof(PackedVertex), evalScratch,
+			u0, u1, v0, v1);
+		for(int iv = v0; iv < v1; iv++)
+			for(int iu = u0; iu < u1; iu++) {
+				PackedVertex *vx = &verts[iv*Nu + iu];
+				if(vx->normal == 0)
+					vx->normal = PackNormal(EvalNormal(tableU.params[iu], tableV.params[iv]));
+				SetColorUV(vx);
+			}
+		if(partial) {
+			for(int iv = v0; iv < v1; iv++)
+				surfaceMesh->UpdateMesh(iv*Nu + u0, u1-u0);
+			return;
+		}
+		if(surfaceMesh && !(dirty & DIRTY_TESS)) {
+			surfaceMesh->UpdateMesh();
+			return;
+		}
+	}
+
+	GridTriangles(indices, Nu, Nv);
 
-	surfaceMesh = CreateMesh(GL_TRIANGLES, Nu*Nv, verts, numIndices, indices, sizeof(Vertex));
+	if(surfaceMesh) {
+		surfaceMesh->submeshes[0].numIndices = numIndices;
+		if(!staleVertices)
+			surfaceMesh->UpdateMesh();
+		surfaceMesh->UpdateIndices();
+		return;
+	}
+	surfaceMesh = CreateMesh(GL_TRIANGLES, Nu*Nv, verts, numIndices, indices, &packedVertexLayout);
+}
+
+// CVs, sample parameters and knots for nurbs.comp.
+// After local edits only the rows of moved CVs are uploaded.
+void
+Surface::UpdateBuffers(void)
+{
+	int n = numU*numV;
+	bool all = cvBuffer == 0 || dirty & (DIRTY_POS|DIRTY_KNOTS);
+	if(cvBuffer == 0 || dirty & DIRTY_KNOTS) {
+		// number of CVs can change with the knots
+		glDeleteBuffers(1, &cvBuffer);
+		glCreateBuffers(1, &cvBuffer);
+		glNamedBufferStorage(cvBuffer, n*sizeof(vec4), nil, GL_DYNAMIC_STORAGE_BIT);
+	}
+	if(all) {
+		std::vector<vec4> pos(n);
+		for(int i = 0; i < n; i++)
+			pos[i] = CVs[i].pos;
+		glNamedBufferSubData(cvBuffer, 0, n*sizeof(vec4), &pos[0]);
+	} else if(dirty & DIRTY_CVS) {
+		vec4 pos[64];
+		for(int iv = editV0; iv <= editV1; iv++)
+			for(int iu = editU0; iu <= editU1; iu += nelem(pos)) {
+				int m = min(editU1+1 - iu, (int)nelem(pos));
+				for(int i = 0; i < m; i++)
+					pos[i] = CVs[iv*numU + iu+i].pos;
+				glNamedBufferSubData(cvBuffer, (iv*numU + iu)*sizeof(vec4), m*sizeof(vec4), pos);
+			}
+	}
+
+	if(paramBuffer == 0 || dirty & (DIRTY_KNOTS|DIRTY_TESS)) {
+		std::vector<float> params;
+		params.insert(params.end(), tableU.params.begin(), tableU.params.end());
+		params.insert(params.end(), tableV.params.begin(), tableV.params.end());
+		params.insert(params.end(), knotsU.begin(), knotsU.end());
+		params.insert(params.end(), knotsV.begin(), knotsV.end());
+		glDeleteBuffers(1, &paramBuffer);
+		glCreateBuffers(1, &paramBuffer);
+		glNamedBufferStorage(paramBuffer, params.size()*sizeof(float), &params[0], GL_DYNAMIC_STORAGE_BIT);
+	}
+}
+
+// the buffers go stale while the CPU tessellates
+void
+Surface::FreeBuffers(void)
+{
+	if(cvBuffer == 0)
+		return;
+	glDeleteBuffers(1, &cvBuffer);
+	glDeleteBuffers(1, &paramBuffer);
+	cvBuffer = 0;
+	paramBuffer = 0;
+}
+
+// Evaluate samples [u0,u1) x [v0,v1) into surfaceMesh's vertex buffer
+void
+Surface::ComputeSurface(int u0, int u1, int v0, int v1)
+{
+	UpdateBuffers();
+	glUseProgram(nurbsProg.program);
+	glUniform2i(nurbsProg.u_degree, degreeU, degreeV);
+	glUniform2i(nurbsProg.u_numCVs, numU, numV);
+	glUniform2i(nurbsProg.u_numSamples, tableU.numSamples, tableV.numSamples);
+	glUniform4i(nurbsProg.u_sampleRange, u0, v0, u1, v1);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cvBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, paramBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, surfaceMesh->vbo);
+	glDispatchCompute((u1-u0 + 7)/8, (v1-v0 + 7)/8, 1);
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	if(curProg)
+		glUseProgram(curProg->program);
+}
+
+// read back what the GPU computed
+void
+Surface::SyncVertices(void)
+{
+	if(!staleVertices)
+		return;
+	glGetNamedBufferSubData(surfaceMesh->vbo, 0, surfaceMesh->numVertices*surfaceMesh->stride, surfaceMesh->vertices);
+	// nurbs.comp moved them, the triangle hierarchy has to follow
+	surfaceMesh->bvhStale = true;
+	staleVertices = false;
+}
+
+// for every parameter the grid sample it falls on, -1 if none
+static void
+GridIndices(const BasisTable &table, const std::vector<float> &params, std::vector<int> &indices)
+{
+	indices.resize(params.size());
+	for(u32 i = 0; i < params.size(); i++) {
+		int j = std::lower_bound(table.params.begin(), table.params.end(), params[i]) - table.params.begin();
+		indices[i] = j < table.numSamples && table.params[j] == params[i] ? j : -1;
+	}
+}
+
+// Isoparm samples [u0,u1) of rows [iv0,iv1) and [v0,v1) of columns [iu0,iu1).
+// Isoparms on the tessellation grid are copied from it, the rest are evaluated.
+void
+Surface::IsoparmSamples(LineVertex *verts, const PackedVertex *grid, int u0, int u1, int iv0, int iv1,
+	int iu0, int iu1, int v0, int v1)
+{
+	int Nu = tableU.numSamples;
+	int Nv = tableV.numSamples;
+	LineVertex *verts2 = &verts[isoTableV.numSamples*Nu];
+	for(int iv = iv0; iv < iv1; iv++) {
+		int row = grid ? isoGridV[iv] : -1;
+		if(row >= 0)
+			for(int iu = u0; iu < u1; iu++)
+				memcpy(verts[iv*Nu + iu].pos, grid[row*Nu + iu].pos, sizeof(verts->pos));
+		else
+			EvalSurfaceGridRange(&CVs[0].pos, sizeof(ControlVertex), numU, tableU, isoTableV,
+				(vec3*)verts[0].pos, nil, sizeof(LineVertex), Nu*sizeof(LineVertex), evalScratch,
+				u0, u1, iv, iv+1);
+	}
+	for(int iu = iu0; iu < iu1; iu++) {
+		int col = grid ? isoGridU[iu] : -1;
+		if(col >= 0)
+			for(int iv = v0; iv < v1; iv++)
+				memcpy(verts2[iu*Nv + iv].pos, grid[iv*Nu + col].pos, sizeof(verts->pos));
+		else
+			EvalSurfaceGridRange(&CVs[0].pos, sizeof(ControlVertex), numU, isoTableU, tableV,
+				(vec3*)verts2[0].pos, nil, Nv*sizeof(LineVertex), sizeof(LineVertex), evalScratch,
+				iu, iu+1, v0, v1);
+	}
 }
 
 void
 Surface::UpdateCurve(void)
 {
-	if(!dirty)
+	// keep the curves of the drawn grid
+	if(!dirty || tessJob)
 		return;
 
-	float minU = knotsU[0];
-	float maxU = knotsU[knotsU.size()-1];
-	float minV = knotsV[0];
-	float maxV = knotsV[knotsV.size()-1];
-	float eps = 0.0001f;
+	// isoparms at the distinct knots inside the domain
+	float minU = knotsU[degreeU];
+	float maxU = knotsU[numU];
+	float minV = knotsV[degreeV];
+	float maxV = knotsV[numV];
 	std::vector<float> isoU;
 	std::vector<float> isoV;
 	for(u32 i = 0; i < knotsU.size(); i++)
 		if(i == 0 || knotsU[i] != knotsU[i-1])
-			isoU.push_back(knotsU[i]);
+			isoU.push_back(clamp(knotsU[i], minU, maxU));
 	for(u32 i = 0; i < knotsV.size(); i++)
 		if(i == 0 || knotsV[i] != knotsV[i-1])
-			isoV.push_back(knotsV[i]);
+			isoV.push_back(clamp(knotsV[i], minV, maxV));
 
 	int Iu = isoU.size();
 	int Iv = isoV.size();
-	int Nu = 5 * (numU - degreeU) + 1;
-	int Nv = 5 * (numV - degreeV) + 1;
+	int Nu = tableU.numSamples;
+	int Nv = tableV.numSamples;
 
 	int N = Iv*Nu + Iu*Nv;
 	int numIndices = 2*Iv*(Nu-1) + 2*Iu*(Nv-1);
-	Vertex *verts, *verts2;
+	LineVertex *verts;
 	u16 *indices;
 
-	if(dirty & DIRTY_POS || curveMesh == nil) {
+	if(curveMesh && dirty & DIRTY_TESS)
+		curveMesh->Resize(N, numIndices);
+
+	// the surface grid is only on the CPU without computeTessellation
+	const PackedVertex *grid = surfaceMesh && !staleVertices ? (PackedVertex*)surfaceMesh->vertices : nil;
+
+	int u0, u1, v0, v1;
+	int iu0, iu1, iv0, iv1;
+	if(curveMesh && EditedSamples(tableU, isoTableV, &u0, &u1, &iv0, &iv1) &&
+	   EditedSamples(isoTableU, tableV, &iu0, &iu1, &v0, &v1)) {
+		// only the pieces of the isoparms near the moved CVs
+		verts = (LineVertex*)curveMesh->vertices;
+		IsoparmSamples(verts, grid, u0, u1, iv0, iv1, iu0, iu1, v0, v1);
+		if(u0 < u1)
+			for(int iv = iv0; iv < iv1; iv++)
+				curveMesh->UpdateMesh(iv*Nu + u0, u1-u0);
+		if(v0 < v1)
+			for(int iu = iu0; iu < iu1; iu++)
+				curveMesh->UpdateMesh(Iv*Nu + iu*Nv + v0, v1-v0);
+	} else if(dirty & (DIRTY_POS|DIRTY_TESS) || curveMesh == nil) {
 		if(curveMesh)
-			verts = (Vertex*)curveMesh->vertices;
+			verts = (LineVertex*)curveMesh->vertices;
 		else
-			verts = new Vertex[N];
-		verts2 = &verts[Iv*Nu];
+			verts = new LineVertex[N];
 
-		for(int iv = 0; iv < Iv; iv++) {
-			float v = clamp(isoV[iv], minV, maxV-eps);
-			for(int iu = 0; iu < Nu; iu++) {
-				float u = (float)iu/(Nu-1) * (minU+maxU) - minU;
-				u = clamp(u, minU, maxU-eps);
-				vec3 pos = Eval(u, v);
-				Vertex *vx = &verts[iv*Nu + iu];
-				vx->pos[0] = pos.x;
-				vx->pos[1] = pos.y;
-				vx->pos[2] = pos.z;
-				vx->color[0] = 0;
-				vx->color[1] = 0;
-				vx->color[2] = 0;
-				vx->color[3] = 255;
-			}
-		}
-		for(int iu = 0; iu < Iu; iu++) {
-			float u = clamp(isoU[iu], minU, maxU-eps);
-			for(int iv = 0; iv < Nv; iv++) {
-				float v = (float)iv/(Nv-1) * (minV+maxV) - minV;
-				v = clamp(v, minV, maxV-eps);
-				vec3 pos = Eval(u, v);
-				Vertex *vx = &verts2[iu*Nv + iv];
-				vx->pos[0] = pos.x;
-				vx->pos[1] = pos.y;
-				vx->pos[2] = pos.z;
-				vx->color[0] = 0;
-				vx->color[1] = 0;
-				vx->color[2] = 0;
-				vx->color[3] = 255;
-			}
+		// the grid tables are up to date since UpdateSurface ran first
+		if(dirty & DIRTY_KNOTS || isoTableU.numSamples != Iu)
+			isoTableU.Build(&isoU[0], Iu, degreeU, numU, &knotsU[0]);
+		if(dirty & DIRTY_KNOTS || isoTableV.numSamples != Iv)
+			isoTableV.Build(&isoV[0], Iv, degreeV, numV, &knotsV[0]);
+		GridIndices(tableU, isoU, isoGridU);
+		GridIndices(tableV, isoV, isoGridV);
+		IsoparmSamples(verts, grid, 0, Nu, 0, Iv, 0, Iu, 0, Nv);
+		for(int i = 0; i < N; i++) {
+			verts[i].color[0] = 0;
+			verts[i].color[1] = 0;
+			verts[i].color[2] = 0;
+			verts[i].color[3] = 255;
 		}
 		if(curveMesh)
 			curveMesh->UpdateMesh();
 	}
 
-	if(dirty & DIRTY_SEL || curveMesh == nil) {
+	if(dirty & (DIRTY_SEL|DIRTY_TESS) || curveMesh == nil) {
 		std::vector<u8> activeSpans(knotsU.size()*knotsV.size());
 		for(int iv = 0; iv < numV; iv++)
 			for(int iu = 0; iu < numU; iu++)
@@ -364,15 +941,20 @@ Surface::UpdateCurve(void)
 			indices = curveMesh->indices;
 		else
 			indices = new u16[numIndices];
+		// knot interval of every grid segment
+		std::vector<int> intervalU(Nu-1), intervalV(Nv-1);
+		for(int iu = 0; iu < Nu-1; iu++)
+			intervalU[iu] = FindParamU(tableU.params[iu+1]);
+		for(int iv = 0; iv < Nv-1; iv++)
+			intervalV[iv] = FindParamV(tableV.params[iv+1]);
+
 		int idx = 0;
 		int idxu = numIndices;
 // TODO: the highlight logic is not quite right
-		for(int iv = 0; iv < Iv; iv++)
+		for(int iv = 0; iv < Iv; iv++) {
+			int i1 = FindParamV(isoV[iv]);
 			for(int iu = 0; iu < Nu-1; iu++) {
-				float u1 = (float)(iu+1)/(Nu-1) * (minU+maxU) - minU;
-				float v1 = isoV[iv];
-				int i1 = FindParamV(v1);
-				int j1 = FindParamU(u1);
+				int j1 = intervalU[iu];
 
 				if(activeSpans[i1*knotsU.size() + j1]) {
 					indices[--idxu] = iv*Nu + iu+1;
@@ -382,12 +964,11 @@ Surface::UpdateCurve(void)
 					indices[idx++] = iv*Nu + iu+1;
 				}
 			}
-		for(int iu = 0; iu < Iu; iu++)
+		}
+		for(int iu = 0; iu < Iu; iu++) {
+			int j1 = FindParamU(isoU[iu]);
 			for(int iv = 0; iv < Nv-1; iv++) {
-				float u1 = isoU[iu];
-				float v1 = (float)(iv+1)/(Nv-1) * (minV+maxV) - minV;
-				int i1 = FindParamV(v1);
-				int j1 = FindParamU(u1);
+				int i1 = intervalV[iv];
 
 				if(activeSpans[i1*knotsU.size() + j1]) {
 					indices[--idxu] = Iv*Nu + iu*Nv + iv+1;
@@ -397,6 +978,7 @@ Surface::UpdateCurve(void)
 					indices[idx++] = Iv*Nu + iu*Nv + iv+1;
 				}
 			}
+		}
 
 		if(curveMesh) {
 			curveMesh->submeshes[0].numIndices = idx;
@@ -406,7 +988,7 @@ Surface::UpdateCurve(void)
 	}
 
 	if(curveMesh == nil) {
-		curveMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, sizeof(Vertex));
+		curveMesh = CreateMesh(GL_LINES, N, verts, numIndices, indices, &lineVertexLayout);
 		curveMesh->submeshes[0].matID = MATID_WIRE;
 		Mesh::Submesh sm;
 		sm.numIndices = 0;
@@ -418,33 +1000,121 @@ Surface::UpdateCurve(void)
 vec3
 Surface::Eval(float u, float v)
 {
+	float Nu[MAX_DEGREE+1], Nv[MAX_DEGREE+1];
+	int spanU = FindSpan(u, degreeU, numU, &knotsU[0]);
+	int spanV = FindSpan(v, degreeV, numV, &knotsV[0]);
+	EvalBasis(u, spanU, degreeU, &knotsU[0], Nu);
+	EvalBasis(v, spanV, degreeV, &knotsV[0], Nv);
 	vec4 out(0.0f);
-	std::vector<float> basisU(numU);
-	std::vector<float> basisV(numV);
-	for(int i = 0; i < numU; i++) basisU[i] = evalBasis(u, i, degreeU, &knotsU[0]);
-	for(int i = 0; i < numV; i++) basisV[i] = evalBasis(v, i, degreeV, &knotsV[0]);
-	for(int iv = 0; iv < numV; iv++)
-		for(int iu = 0; iu < numU; iu++)
-			out += basisU[iu] * basisV[iv] * CVs[iv*numU + iu].pos;
+	for(int j = 0; j <= degreeV; j++) {
+		ControlVertex *row = &CVs[(spanV-degreeV+j)*numU + spanU-degreeU];
+		vec4 tmp(0.0f);
+		for(int i = 0; i <= degreeU; i++)
+			tmp += Nu[i] * row[i].pos;
+		out += Nv[j] * tmp;
+	}
 	return vec3(out)/out.w;
 }
 
+void
+Surface::EvalDerivs(float u, float v, vec3 *pos, vec3 *du, vec3 *dv)
+{
+	float Nu[MAX_DEGREE+1], Nv[MAX_DEGREE+1];
+	float dNu[MAX_DEGREE+1], dNv[MAX_DEGREE+1];
+	int spanU = FindSpan(u, degreeU, numU, &knotsU[0]);
+	int spanV = FindSpan(v, degreeV, numV, &knotsV[0]);
+	EvalBasisDerivs(u, spanU, degreeU, &knotsU[0], Nu, dNu);
+	EvalBasisDerivs(v, spanV, degreeV, &knotsV[0], Nv, dNv);
+	vec4 S(0.0f), Su(0.0f), Sv(0.0f);
+	for(int j = 0; j <= degreeV; j++) {
+		ControlVertex *row = &CVs[(spanV-degreeV+j)*numU + spanU-degreeU];
+		vec4 P(0.0f), Pu(0.0f);
+		for(int i = 0; i <= degreeU; i++) {
+			P += Nu[i] * row[i].pos;
+			Pu += dNu[i] * row[i].pos;
+		}
+		S += Nv[j]*P;
+		Su += Nv[j]*Pu;
+		Sv += dNv[j]*P;
+	}
+	*pos = vec3(S)/S.w;
+	*du = (vec3(Su) - *pos*Su.w)/S.w;
+	*dv = (vec3(Sv) - *pos*Sv.w)/S.w;
+}
+
+// at collapsed edges take the normal from just inside the surface
+vec3
+Surface::EvalNormal(float u, float v)
+{
+	vec3 pos, du, dv, n;
+	EvalDerivs(u, v, &pos, &du, &dv);
+	if(NormalFromDerivs(du, dv, &n))
+		return n;
+	float cu = (knotsU[degreeU] + knotsU[numU])/2.0f;
+	float cv = (knotsV[degreeV] + knotsV[numV])/2.0f;
+	EvalDerivs(u + (cu-u)*0.002f, v + (cv-v)*0.002f, &pos, &du, &dv);
+	if(NormalFromDerivs(du, dv, &n))
+		return n;
+	return vec3(0.0f, 0.0f, 1.0f);
+}
+
 int
 Surface::FindParamU(float u)
 {
-	for(u32 i = 0; i < knotsU.size()-1; i++)
-		if(knotsU[i] <= u && u <= knotsU[i+1])
-			return i;
-	return -1;
+	return FindInterval(u, knotsU.size(), &knotsU[0]);
 }
 
 int
 Surface::FindParamV(float v)
 {
-	for(u32 i = 0; i < knotsV.size()-1; i++)
-		if(knotsV[i] <= v && v <= knotsV[i+1])
-			return i;
-	return -1;
+	return FindInterval(v, knotsV.size(), &knotsV[0]);
+}
+
+// Bezier patches, kept until CVs or knots change
+const BezierForm&
+Surface::GetBezierForm(void)
+{
+	if(dirty & (DIRTY_POS|DIRTY_KNOTS|DIRTY_CVS))
+		bezier.valid = false;
+	if(!bezier.valid) {
+		bezier.FromSurface(&CVs[0].pos, sizeof(ControlVertex), degreeU, degreeV, numU, numV,
+			&knotsU[0], &knotsV[0]);
+		bezier.valid = true;
+	}
+	return bezier;
+}
+
+// Closest point to p in object space and its parameters
+vec3
+Surface::Project(vec3 p, float *u, float *v)
+{
+	vec3 out;
+	ProjectBatch(&p, 1, u, v, &out);
+	return out;
+}
+
+// Each closest point bounds the search for the next one,
+// so nearby points go much faster than scattered ones
+void
+Surface::ProjectBatch(const vec3 *points, int n, float *u, float *v, vec3 *out)
+{
+	const BezierForm &bz = GetBezierForm();
+	for(int i = 0; i < n; i++) {
+		float d = i > 0 ? glm::distance2(points[i], out[i-1]) : FLT_MAX;
+		if(bz.Project(points[i], d, u[i], v[i], out[i]))
+			continue;
+		// the previous point is closest,
+		// or there is nothing to go by (no spans, p not finite)
+		if(i > 0) {
+			u[i] = u[i-1];
+			v[i] = v[i-1];
+			out[i] = out[i-1];
+		} else {
+			u[i] = knotsU[degreeU];
+			v[i] = knotsV[degreeV];
+			out[i] = Eval(u[i], v[i]);
+		}
+	}
 }
 
 void
@@ -462,6 +1132,104 @@ Surface::FrustumPickCVs(const mat4 &matrix, const vec4 *planes, std::vector<Pick
 }
 
 
+// Knots of a curve mapped to [0,1]
+static std::vector<float>
+UnitKnots(const Curve *c)
+{
+	int p = c->degree;
+	int n = c->CVs.size();
+	float k0 = c->knots[p];
+	float k1 = c->knots[n];
+	std::vector<float> knots(c->knots.size());
+	for(u32 i = 0; i < knots.size(); i++)
+		knots[i] = clamp((c->knots[i] - k0)/(k1 - k0), 0.0f, 1.0f);
+	return knots;
+}
+
+// Surface through the curves, which become its isoparms in u.
+// The curves are brought to the same knots by knot insertion,
+// then every column of CVs is interpolated in v like InterpolateCurve does.
+// The curves must have the same degree and clamped knots.
+Surface*
+LoftSurface(Curve **curves, int n, int degreeV, bool centripetal)
+{
+	if(n < 2)
+		return nil;
+	int p = curves[0]->degree;
+	for(int j = 1; j < n; j++)
+		if(curves[j]->degree != p)
+			return nil;
+
+	// union of the knots with the highest multiplicity
+	std::vector<float> knotsU;
+	for(int j = 0; j < n; j++) {
+		std::vector<float> knots = UnitKnots(curves[j]);
+		std::vector<float> merged;
+		std::set_union(knotsU.begin(), knotsU.end(), knots.begin(), knots.end(), std::back_inserter(merged));
+		knotsU.swap(merged);
+	}
+	int numU = knotsU.size() - p-1;
+
+	// all curves on knotsU, rows of homogeneous CVs
+	std::vector<vec4> rows(n*numU);
+	for(int j = 0; j < n; j++) {
+		std::vector<float> knots = UnitKnots(curves[j]);
+		std::vector<vec4> cvs(curves[j]->CVs.size());
+		for(u32 i = 0; i < cvs.size(); i++)
+			cvs[i] = curves[j]->CVs[i].pos;
+		for(u32 k = 0; k < knotsU.size(); ) {
+			float u = knotsU[k];
+			int need = 0;
+			for(; k < knotsU.size() && knotsU[k] == u; k++)
+				need++;
+			int have = std::upper_bound(knots.begin(), knots.end(), u) - std::lower_bound(knots.begin(), knots.end(), u);
+			if(need <= have)
+				continue;
+			std::vector<float> newKnots(knots.size() + need-have);
+			std::vector<vec4> newCVs(cvs.size() + need-have);
+			int r = InsertKnot(u, need-have, p, cvs.size(), &knots[0], &cvs[0], sizeof(vec4),
+				&newKnots[0], &newCVs[0], sizeof(vec4));
+			assert(r == need-have);
+			knots.swap(newKnots);
+			cvs.swap(newCVs);
+		}
+		assert((int)cvs.size() == numU);
+		for(int i = 0; i < numU; i++)
+			rows[j*numU + i] = cvs[i];
+	}
+
+	// v parameters averaged over the columns
+	int q = min(degreeV, n-1);
+	std::vector<float> params(n, 0.0f);
+	std::vector<float> colParams(n);
+	for(int i = 0; i < numU; i++) {
+		InterpParams(&rows[i], numU*sizeof(vec4), n, centripetal, &colParams[0]);
+		for(int j = 0; j < n; j++)
+			params[j] += colParams[j]/numU;
+	}
+	params[0] = 0.0f;
+	params[n-1] = 1.0f;
+
+	Surface *surf = new Surface;
+	surf->degreeU = p;
+	surf->degreeV = q;
+	surf->numU = numU;
+	surf->numV = n;
+	surf->knotsU = knotsU;
+	surf->knotsV.resize(n+q+1);
+	AveragedKnots(&params[0], n, q, &surf->knotsV[0]);
+	surf->CVs.resize(numU*n);
+	for(int i = 0; i < numU*n; i++)
+		surf->CVs[i].parent = surf;
+	for(int i = 0; i < numU; i++)
+		if(!SolveCollocation(&params[0], n, q, &surf->knotsV[0], &rows[i], numU*sizeof(vec4),
+		   &surf->CVs[i].pos, numU*sizeof(ControlVertex))) {
+			delete surf;
+			return nil;
+		}
+	return surf;
+}
+
 Node*
 CreateTestSurface(void)
 {
@@ -541,3 +1309,38 @@ CreateTestSurface(void)
 
 	return n;
 }
+
+// A vase lofted through profiles interpolated from points,
+// the profiles are children of the surface
+Node*
+CreateTestLoft(void)
+{
+	static const float heights[] = { 0.0f, 0.8f, 2.0f, 3.0f, 3.6f };
+	static const float radii[] = { 1.0f, 1.6f, 1.1f, 0.6f, 0.9f };
+	const int numPoints = 9;
+	const int numProfiles = nelem(heights);
+
+	Node *n = new Node("TestLoft");
+	Curve *profiles[numProfiles];
+	for(int j = 0; j < numProfiles; j++) {
+		vec3 points[numPoints];
+		for(int i = 0; i < numPoints; i++) {
+			float a = PI*i/(numPoints-1);
+			points[i] = vec3(radii[j]*cosf(a), radii[j]*sinf(a), heights[j]);
+		}
+		profiles[j] = InterpolateCurve(points, numPoints, 3, false);
+		assert(profiles[j]);
+	}
+	Surface *surf = LoftSurface(profiles, numProfiles, 3, false);
+	assert(surf);
+	n->AttachMesh(surf);
+	// children are prepended
+	for(int j = numProfiles-1; j >= 0; j--) {
+		char name[32];
+		snprintf(name, sizeof(name), "profile%d", j);
+		Node *c = new Node(name);
+		c->AttachMesh(profiles[j]);
+		n->AddChild(c);
+	}
+	return n;
+}